@@ -0,0 +1,320 @@
+#define _GNU_SOURCE              // Enable posix_openpt() and other extensions
+#include <errno.h>       // Include error numbers
+#include <fcntl.h>       // Include file control options
+#include <poll.h>        // Include poll for waiting on the shell's terminal
+#include <signal.h>      // Include kill for stopping a stuck shell
+#include <spawn.h>       // Include posix_spawn for starting the shell in the startup workload
+#include <stdint.h>      // Include fixed-width integer types
+#include <stdio.h>       // Include standard input/output library
+#include <stdlib.h>      // Include standard library for memory allocation, process control, etc.
+#include <string.h>      // Include string handling functions
+#include <termios.h>     // Include raw mode for the pseudo-terminal
+#include <time.h>        // Include clock_gettime for latency measurements
+#include <unistd.h>      // Include POSIX operating system API
+#include <sys/ioctl.h>   // Include TIOCSCTTY for giving the shell a controlling terminal
+#include <sys/resource.h> // Include the peak RSS of reaped shells
+#include <sys/wait.h>    // Include declarations for waiting
+
+// Benchmark driver for the shell: runs it on a pseudo-terminal so it behaves
+// interactively, feeds it synthetic command lines and measures how fast it answers
+//
+// Usage: bench [./shell [commands per workload]]
+//        bench -s ./shell [starts]   measures how long the shell takes to start and exit
+
+// Prompt the shell is started with, a command has finished once it shows up again
+#define PROMPT "bench> "
+// Arguments on a line of the long-arguments workload
+#define LONG_ARGS 512
+// Seconds to wait for the shell before giving up on a workload
+#define TIMEOUT_SEC 60
+
+// The shell under test and the master side of its terminal
+struct shell {
+    pid_t pid;          // Process ID of the shell
+    int fd;             // Master side of the pseudo-terminal
+};
+
+// Counter of the occurrences of a string in the shell's output
+struct matcher {
+    const char *pattern;    // String that is counted
+    size_t matched;         // Bytes of pattern matched by the most recent output
+    size_t count;           // Complete occurrences seen so far
+};
+
+// Function to read the monotonic clock in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Function to feed output through a matcher, the pattern has no repeated prefix so no backtracking is needed
+void match_output(struct matcher *m, const char *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (buf[i] == m->pattern[m->matched]) {
+            if (m->pattern[++m->matched] == '\0') {
+                m->count++;
+                m->matched = 0;
+            }
+        } else {
+            m->matched = buf[i] == m->pattern[0];
+        }
+    }
+}
+
+// Function to start the shell on a new pseudo-terminal in raw mode
+int start_shell(struct shell *sh, const char *path) {
+    struct termios tio;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+    // Non-blocking, or a large write could wait on the shell while it waits on us to read
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    sh->fd = fd;
+    if ((sh->pid = fork()) < 0) {
+        perror("fork");
+        return -1;
+    } else if (sh->pid == 0) {  // Child process
+        const char *slave = ptsname(fd);
+        int tty;
+        setsid(); // The terminal becomes the shell's controlling terminal
+        if (slave == NULL || (tty = open(slave, O_RDWR)) < 0) {
+            _exit(127);
+        }
+        ioctl(tty, TIOCSCTTY, 0);
+        // No echo and no line editing, the driver sees exactly what the shell writes
+        tcgetattr(tty, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(tty, TCSANOW, &tio);
+        dup2(tty, STDIN_FILENO);
+        dup2(tty, STDOUT_FILENO);
+        dup2(tty, STDERR_FILENO);
+        close(tty);
+        setenv("HISTFILE", "/dev/null", 1); // Thousands of commands would bury the user's history
+        execl(path, path, "-p", PROMPT, (char *) NULL);
+        _exit(127);
+    }
+    return 0;
+}
+
+// Function to write input to the shell while reading its output, until the matcher has seen count occurrences
+// Returns -1 if the shell went away or the timeout expired
+int pump(struct shell *sh, const char *in, size_t len, struct matcher *m, size_t count) {
+    uint64_t deadline = now_ns() + TIMEOUT_SEC * 1000000000ull;
+    char buf[1 << 16];
+
+    while (m->count < count || len > 0) {
+        struct pollfd pfd = { .fd = sh->fd, .events = POLLIN | (len > 0 ? POLLOUT : 0) };
+        if (now_ns() > deadline) {
+            fprintf(stderr, "bench: timed out waiting for the shell\n");
+            return -1;
+        }
+        if (poll(&pfd, 1, 1000) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+        // Keep reading so the shell never blocks on a full terminal while we write
+        if (pfd.revents & POLLIN) {
+            ssize_t n = read(sh->fd, buf, sizeof(buf));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                fprintf(stderr, "bench: the shell exited\n");
+                return -1;
+            }
+            match_output(m, buf, n);
+        } else if (pfd.revents & (POLLHUP | POLLERR)) {
+            fprintf(stderr, "bench: the shell exited\n");
+            return -1;
+        }
+        if (len > 0 && (pfd.revents & POLLOUT)) {
+            ssize_t n = write(sh->fd, in, len);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("write");
+                return -1;
+            }
+            if (n > 0) {
+                in += n;
+                len -= n;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to read the shell's peak resident set size from /proc, in kilobytes
+long peak_rss(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// Function to compare latencies for qsort
+int compare_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to print one row of the results table
+void report(const char *name, size_t n, uint64_t elapsed, uint64_t *lat, long rss) {
+    printf("%-12s %8zu %12.0f", name, n, n / (elapsed / 1e9));
+    if (lat != NULL) {
+        qsort(lat, n, sizeof(*lat), compare_ns);
+        printf(" %10.1f %10.1f", lat[n / 2] / 1e3, lat[n - 1 - n / 100] / 1e3);
+    } else {
+        printf(" %10s %10s", "-", "-"); // Launches overlap, there is no per-command latency
+    }
+    printf(" %10ld\n", rss);
+    fflush(stdout);
+}
+
+// Function to run a workload one command at a time, timing each until the prompt returns
+int run_serial(struct shell *sh, const char *name, const char *line, size_t n) {
+    struct matcher m = { PROMPT, 0, 0 };
+    uint64_t *lat = malloc(n * sizeof(*lat)), start = now_ns();
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        if (pump(sh, line, strlen(line), &m, i + 1) < 0) {
+            free(lat);
+            return -1;
+        }
+        lat[i] = now_ns() - t;
+    }
+    report(name, n, now_ns() - start, lat, peak_rss(sh->pid));
+    free(lat);
+    return 0;
+}
+
+// Function to launch n background jobs at once and wait until all of them were reported
+int run_fanout(struct shell *sh, const char *name, size_t n) {
+    struct matcher m = { "Exited", 0, 0 };
+    const char *line = "true &\n";
+    size_t len = strlen(line);
+    char *in = malloc(n * len);
+    uint64_t start;
+
+    for (size_t i = 0; i < n; i++) {
+        memcpy(&in[i * len], line, len);
+    }
+    start = now_ns();
+    if (pump(sh, in, n * len, &m, n) < 0) {
+        free(in);
+        return -1;
+    }
+    report(name, n, now_ns() - start, NULL, peak_rss(sh->pid));
+    free(in);
+    return 0;
+}
+
+// Function to start the shell n times with a command that ends it at once, timing each run
+// until the shell has been reaped; the peak RSS is the largest of any run
+int run_startup(const char *path, size_t n) {
+    char *argv[] = { (char *) path, "-c", "exit", NULL };
+    uint64_t *lat = malloc(n * sizeof(*lat)), start = now_ns();
+    extern char **environ;
+    struct rusage ru;
+    long rss = 0;
+    int status;
+    pid_t pid;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        if ((errno = posix_spawn(&pid, path, NULL, NULL, argv, environ)) != 0) {
+            perror(path);
+            free(lat);
+            return -1;
+        }
+        if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "bench: %s -c exit failed\n", path);
+            free(lat);
+            return -1;
+        }
+        lat[i] = now_ns() - t;
+        rss = ru.ru_maxrss > rss ? ru.ru_maxrss : rss;
+    }
+    report(path, n, now_ns() - start, lat, rss);
+    free(lat);
+    return 0;
+}
+
+// Main function: runs every workload against the shell and prints a table
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "./shell";
+    size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000;
+    struct matcher prompt = { PROMPT, 0, 0 };
+    struct shell sh;
+    char *long_line;
+    size_t off;
+    int status, error = 0;
+
+    // Startup mode starts the shell over and over instead of feeding it commands
+    if (argc > 1 && !strcmp(argv[1], "-s")) {
+        path = argc > 2 ? argv[2] : "./shell";
+        n = argc > 3 ? strtoul(argv[3], NULL, 10) : 2000;
+        if (n == 0) {
+            fprintf(stderr, "Incorrect usage: \n./bench -s [shell [starts]]\n");
+            return 1;
+        }
+        printf("%-12s %8s %12s %10s %10s %10s\n", "binary", "starts", "starts/s", "p50 us", "p99 us", "peak kB");
+        return run_startup(path, n) < 0;
+    }
+    if (n == 0) {
+        fprintf(stderr, "Incorrect usage: \n./bench [shell [commands per workload]]\n");
+        return 1;
+    }
+    if (start_shell(&sh, path) < 0 || pump(&sh, "", 0, &prompt, 1) < 0) {
+        return 1;
+    }
+
+    // true followed by many short arguments, exercising the tokenizer
+    long_line = malloc(LONG_ARGS * 16 + 8);
+    off = sprintf(long_line, "true");
+    for (int i = 0; i < LONG_ARGS; i++) {
+        off += sprintf(&long_line[off], " argument%04d", i);
+    }
+    strcpy(&long_line[off], "\n");
+
+    printf("%-12s %8s %12s %10s %10s %10s\n", "workload", "commands", "commands/s", "p50 us", "p99 us", "peak kB");
+    if (run_serial(&sh, "builtin", "cd .\n", n) < 0 ||
+        run_serial(&sh, "external", "true\n", n) < 0 ||
+        run_serial(&sh, "long-args", long_line, n) < 0 ||
+        run_fanout(&sh, "fan-out", n) < 0) {
+        error = 1;
+        kill(sh.pid, SIGKILL);
+    } else if (write(sh.fd, "exit\n", 5) < 0) {
+        kill(sh.pid, SIGKILL);
+    }
+    // The shell exits on its own, draining its output lets it finish writing
+    while (waitpid(sh.pid, &status, WNOHANG) == 0) {
+        char buf[4096];
+        struct pollfd pfd = { .fd = sh.fd, .events = POLLIN };
+        if (poll(&pfd, 1, 100) > 0 && read(sh.fd, buf, sizeof(buf)) <= 0) {
+            waitpid(sh.pid, &status, 0);
+            break;
+        }
+    }
+    close(sh.fd);
+    free(long_line);
+    return error;
+}
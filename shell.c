@@ -1,270 +1,4977 @@
+#define _GNU_SOURCE              // Enable pipe2() and other Linux extensions
 #include <ctype.h>       // Include character type functions
+#include <dirent.h>      // Include the getdents64() record layout and entry types
+#include <errno.h>       // Include error numbers
+#include <fcntl.h>       // Include file control options
+#include <fnmatch.h>     // Include wildcard matching of directory entries
+#include <inttypes.h>    // Include printf formats of fixed-width integers
+#include <poll.h>        // Include poll for waiting on file descriptors
+#include <sched.h>       // Include CPU affinity for placing jobs
+#include <signal.h>      // Include signal handling
+#include <spawn.h>       // Include posix_spawn for launching commands
+#include <stdatomic.h>   // Include lock-free atomics shared with the signal handler
+#include <stddef.h>      // Include max_align_t
 #include <unistd.h>      // Include POSIX operating system API
+#include <stdint.h>      // Include fixed-width integer types
 #include <stdio.h>       // Include standard input/output library
 #include <stdlib.h>      // Include standard library for memory allocation, process control, etc.
 #include <string.h>      // Include string handling functions
+#include <termios.h>     // Include terminal modes restored after foreground jobs
+#include <time.h>        // Include clock_gettime for latency measurements
+#include <sys/epoll.h>   // Include epoll for watching the pidfds of children
+#include <sys/mman.h>    // Include mmap for reading the history file
 #include <sys/param.h>   // Include system parameters
+#include <sys/resource.h> // Include resource usage of reaped children
+#include <sys/socket.h>  // Include sockets for the job event stream
+#include <sys/stat.h>    // Include stat for checking executables
+#include <sys/time.h>    // Include timeradd for adding CPU times
+#include <sys/syscall.h> // Include system call numbers for set_mempolicy, pidfd_open, waitid and getdents64
 #include <sys/types.h>   // Include basic data types
+#include <sys/uio.h>     // Include writev for appending history entries in one write
+#include <sys/un.h>      // Include Unix socket addresses
 #include <sys/wait.h>    // Include declarations for waiting
+#include <linux/mempolicy.h> // Include NUMA memory policy modes
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   // Include SSE2/AVX2 intrinsics for the line scanner
+#endif
+
+// Number of buckets of a latency histogram: bucket 0 counts samples under 1 us,
+// bucket b samples from 2^(b-1) up to 2^b us, the last one everything slower
+#define STAT_BUCKETS 24
+
+// Enumeration of the hot paths the shell times
+enum stat_id {
+    STAT_PARSE,         // Tokenizing a line with gen_pipeline()
+    STAT_BUILTIN,       // Running a builtin with run_built_in()
+    STAT_LAUNCH,        // Launching a process, until it runs the command
+    STAT_WAIT,          // Waiting for a foreground job
+    STAT_REAP,          // Routing reaped children to their jobs
+    NUM_STATS
+};
+
+// Latency statistics of one hot path, plain increments from the shell's only thread
+struct stat_timer {
+    const char *name;   // Name printed by stats
+    uint64_t count;     // Number of samples
+    uint64_t total_ns;  // Sum of all samples
+    uint64_t max_ns;    // Slowest sample
+    uint64_t buckets[STAT_BUCKETS]; // Histogram of the samples
+} stat_timers[NUM_STATS] = {
+    [STAT_PARSE]   = { "parse" },
+    [STAT_BUILTIN] = { "builtin" },
+    [STAT_LAUNCH]  = { "launch" },
+    [STAT_WAIT]    = { "fg-wait" },
+    [STAT_REAP]    = { "reap" },
+};
+
+// Event counters printed by stats
+struct stat_counters {
+    uint64_t lines;         // Command lines tokenized
+    uint64_t children;      // State changes of children routed to jobs
+    uint64_t arena_allocs;  // Allocations carved out of arenas, malloc() calls elsewhere aren't counted
+    uint64_t arena_bytes;   // Bytes they took
+    uint64_t arena_chunks;  // Chunks arenas got from malloc()
+} stat_counters;
+
+// Function to add a sample to the statistics of a hot path
+void record_time(enum stat_id id, uint64_t ns) {
+    struct stat_timer *t = &stat_timers[id];
+    uint64_t us = ns / 1000;
+    int b = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+    t->count++;
+    t->total_ns += ns;
+    t->max_ns = MAX(t->max_ns, ns);
+    t->buckets[MIN(b, STAT_BUCKETS - 1)]++;
+}
+
+// Function to estimate a percentile of a hot path from its histogram, as the upper bound in us
+// of the bucket it falls into; the last bucket has none, the slowest sample stands in for it
+double stat_percentile(const struct stat_timer *t, uint64_t percent) {
+    uint64_t rank = (percent * t->count + 99) / 100 - 1, seen = 0; // The sample at the percentile, rounding up
+    for (int b = 0; b < STAT_BUCKETS - 1; b++) {
+        if ((seen += t->buckets[b]) > rank) {
+            return (double) (1ull << b);
+        }
+    }
+    return t->max_ns / 1e3;
+}
+
+// Default size of an arena chunk, larger requests get a chunk of their own
+#define ARENA_CHUNK_SIZE 4096
+// Most memory an arena holds on to across resets
+#define ARENA_KEEP_MAX (1 << 20)
+
+// Chunk of memory that arena allocations are carved out of
+struct arena_chunk {
+    struct arena_chunk *next;  // Next (older) chunk
+    size_t used;               // Bytes handed out so far
+    size_t size;               // Bytes available in data
+    max_align_t data[];        // Storage, aligned for any object
+};
+
+// Bump allocator whose allocations are all released at once
+struct arena {
+    struct arena_chunk *chunks; // Newest chunk first
+};
+
+// Function to add a chunk of at least size bytes to an arena
+void arena_grow(struct arena *a, size_t size) {
+    struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+    stat_counters.arena_chunks++;
+    chunk->next = a->chunks;
+    chunk->used = 0;
+    chunk->size = size;
+    a->chunks = chunk;
+}
+
+// Function to allocate memory from an arena
+void *arena_alloc(struct arena *a, size_t size) {
+    // Round up so every allocation stays aligned for any type
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (a->chunks == NULL || a->chunks->size - a->chunks->used < size) {
+        arena_grow(a, MAX(ARENA_CHUNK_SIZE, size));
+    }
+    void *p = (char *) a->chunks->data + a->chunks->used;
+    a->chunks->used += size;
+    stat_counters.arena_allocs++;
+    stat_counters.arena_bytes += size;
+    return p;
+}
+
+// Function to copy a string into an arena
+char *arena_strdup(struct arena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(a, len), s, len);
+}
+
+// Function to release all memory of an arena
+void arena_free(struct arena *a) {
+    struct arena_chunk *chunk = a->chunks, *next;
+    for (; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    a->chunks = NULL;
+}
+
+// Function to release every allocation of an arena while keeping its memory
+// Several chunks are merged into one, so a steady workload stops calling malloc
+void arena_reset(struct arena *a) {
+    size_t total = 0;
+    if (a->chunks != NULL && a->chunks->next == NULL && a->chunks->size <= ARENA_KEEP_MAX) {
+        a->chunks->used = 0; // Common case: everything fit in one chunk
+        return;
+    }
+    for (struct arena_chunk *chunk = a->chunks; chunk != NULL; chunk = chunk->next) {
+        total += chunk->size;
+    }
+    arena_free(a);
+    // Outliers don't pin memory for the rest of the session
+    if (total > 0 && total <= ARENA_KEEP_MAX) {
+        arena_grow(a, total);
+    }
+}
+
+// Structure to store the resources used by a job's processes
+struct job_usage {
+    uint64_t start_ns;      // When the job was launched
+    uint64_t end_ns;        // When its last process was reaped, 0 while running
+    struct timeval utime;   // User CPU time of the reaped processes
+    struct timeval stime;   // System CPU time of the reaped processes
+    long maxrss;            // Largest resident set of any process, in kilobytes
+    long nvcsw;             // Voluntary context switches
+    long nivcsw;            // Involuntary context switches
+    int cgroup;             // Set once the fields below were read from the job's cgroup
+    uint64_t cg_usage_usec; // CPU time of everything that ran in the cgroup
+    long cg_peak;           // Peak memory of the cgroup in kilobytes, -1 if unknown
+    uint64_t cg_rbytes;     // Bytes the cgroup read from block devices
+    uint64_t cg_wbytes;     // Bytes the cgroup wrote to block devices
+};
 
 // Structure to keep track of child processes (jobs)
+// A job is a whole pipeline, its processes are listed in pids
 struct job {
-    pid_t pid;          // Process ID
+    int id;             // Job number for %n arguments, 0 until the job is listed
+    pid_t pid;          // Process ID of the first stage, used in reports
+    pid_t pgid;         // Process group of the job, 0 if it shares the shell's
     char *name;         // Name of the job
+    pid_t *pids;        // Process IDs of all stages
+    size_t nprocs;      // Number of entries in pids
+    size_t running;     // Number of processes not reaped yet
+    unsigned char *stopped; // Per process: set while it is stopped by a signal
+    size_t nstopped;    // Number of processes currently stopped
+    pid_t status_pid;   // Process whose status becomes the job's status, the last stage
+    int status;         // Wait status, valid once the job has finished
+    int finished;       // Set when the job has been reaped but not yet reported
+    int state_status;   // Wait status of the last stop or continue of the whole job
+    int notify;         // Set when the job stopped or continued and that wasn't reported yet
+    struct job_usage usage; // Resources used by the processes reaped so far
+    char *cgroup;       // Path of the cgroup the job was started in, NULL if it has none
+};
+
+// Slot of the job index
+struct job_slot {
+    pid_t pid;          // Process ID of a running job process
+    size_t job;         // Position of its job + 1, or 0 if the slot is empty
+};
+
+// List structure to keep track of all child jobs
+struct child_jobs {
+    size_t len;         // Number of jobs currently running or not cleared
+    size_t cap;         // Capacity - maximum number of jobs that can be stored
+    struct job_slot *index; // Open-addressing hash from every running job process to its job
+    size_t index_mask;  // Number of index slots minus one, the slot count is a power of two
+    size_t index_used;  // Number of occupied index slots
+    int next_id;        // Job number given to the next job, starts over when the list empties
+    struct arena names; // Storage for job names and process lists, released in bulk
+    size_t names_live;  // Bytes of names taken by listed jobs
+    size_t names_dead;  // Bytes of names left behind by removed jobs, reclaimed by compaction
+    struct job jobs[];  // Flexible array member to hold the jobs, kept dense for listing
+} *child_jobs = NULL;   // Global pointer to the list of child jobs
+
+// Function to map a PID to its home slot in the job index
+size_t job_index_hash(pid_t pid) {
+    // Fibonacci hashing spreads consecutive PIDs across the table
+    return (size_t) (((uint64_t) (uint32_t) pid * 0x9E3779B97F4A7C15ull) >> 32) & child_jobs->index_mask;
+}
+
+// Function to find the index slot holding a PID, or NULL if the PID has no job
+struct job_slot *find_job_slot(pid_t pid) {
+    if (child_jobs == NULL || child_jobs->index == NULL) {
+        return NULL;
+    }
+    // Linear probing: the PID is somewhere before the first empty slot
+    for (size_t h = job_index_hash(pid); child_jobs->index[h].job != 0; h = (h + 1) & child_jobs->index_mask) {
+        if (child_jobs->index[h].pid == pid) {
+            return &child_jobs->index[h];
+        }
+    }
+    return NULL;
+}
+
+// Function to record that the job at position pos can be found by one of its PIDs
+void insert_job_slot(pid_t pid, size_t pos) {
+    size_t h = job_index_hash(pid);
+    while (child_jobs->index[h].job != 0) {
+        h = (h + 1) & child_jobs->index_mask; // Probe for the next empty slot
+    }
+    child_jobs->index[h].pid = pid;
+    child_jobs->index[h].job = pos + 1;
+    child_jobs->index_used++;
+}
+
+// Function to empty an index slot, shifting later entries back so no tombstones are needed
+void remove_job_slot(struct job_slot *slot) {
+    size_t mask = child_jobs->index_mask;
+    size_t hole = slot - child_jobs->index;
+    for (size_t h = (hole + 1) & mask; child_jobs->index[h].job != 0; h = (h + 1) & mask) {
+        size_t home = job_index_hash(child_jobs->index[h].pid);
+        // Move the entry into the hole unless its home lies cyclically in (hole, h]
+        if (((h - home) & mask) >= ((h - hole) & mask)) {
+            child_jobs->index[hole] = child_jobs->index[h];
+            hole = h;
+        }
+    }
+    child_jobs->index[hole].job = 0;
+    child_jobs->index_used--;
+}
+
+// Function to rebuild the job index with a given number of slots (a power of two)
+// Only processes that haven't been reaped are indexed
+void rebuild_job_index(size_t slots) {
+    free(child_jobs->index);
+    child_jobs->index = calloc(slots, sizeof(struct job_slot));
+    child_jobs->index_mask = slots - 1;
+    child_jobs->index_used = 0;
+    for (size_t i = 0; i < child_jobs->len; i++) {
+        for (size_t k = 0; k < child_jobs->jobs[i].nprocs; k++) {
+            if (child_jobs->jobs[i].pids[k] > 0) {
+                insert_job_slot(child_jobs->jobs[i].pids[k], i);
+            }
+        }
+    }
+}
+
+// Bytes of names removed jobs may leave in the arena before the live ones are compacted
+#define JOB_NAMES_DEAD_MAX (64 * 1024)
+
+// Function to count the arena bytes a job's name, process lists and cgroup path take
+size_t job_names_size(const struct job *j) {
+    const size_t round = sizeof(max_align_t) - 1;  // arena_alloc() rounds every allocation up
+    size_t size = ((strlen(j->name) + 1 + round) & ~round) + ((j->nprocs * sizeof(pid_t) + round) & ~round) +
+                  ((j->nprocs + round) & ~round);
+    if (j->cgroup != NULL) {
+        size += (strlen(j->cgroup) + 1 + round) & ~round;
+    }
+    return size;
+}
+
+// Function to copy what a job references into an arena, pointing the job at the copies
+void move_job_names(struct job *j, struct arena *a) {
+    j->name = arena_strdup(a, j->name);
+    j->pids = memcpy(arena_alloc(a, j->nprocs * sizeof(pid_t)), j->pids, j->nprocs * sizeof(pid_t));
+    j->stopped = memcpy(arena_alloc(a, j->nprocs), j->stopped, j->nprocs);
+    j->cgroup = j->cgroup != NULL ? arena_strdup(a, j->cgroup) : NULL;
+}
+
+// Function to move the listed jobs' names into a fresh arena, dropping what removed jobs left behind
+void compact_job_names(void) {
+    struct arena fresh = { NULL };
+    for (size_t i = 0; i < child_jobs->len; i++) {
+        move_job_names(&child_jobs->jobs[i], &fresh);
+    }
+    arena_free(&child_jobs->names);
+    child_jobs->names = fresh;
+    child_jobs->names_dead = 0;
+}
+
+// Function to remove the job at a position in the list
+void free_job(size_t i) {
+    struct job *j = &child_jobs->jobs[i];
+    size_t last = child_jobs->len - 1;
+    struct job_slot *slot;
+
+    // Unindex processes that are still running, the name stays in the arena until it is reclaimed
+    for (size_t k = 0; k < j->nprocs; k++) {
+        if (j->pids[k] > 0 && (slot = find_job_slot(j->pids[k])) != NULL) {
+            remove_job_slot(slot);
+        }
+    }
+    size_t size = job_names_size(j);
+    child_jobs->names_live -= size;
+    child_jobs->names_dead += size;
+    // Shift the last job to the current position if not the last one
+    if (i < last) {
+        memcpy(j, &child_jobs->jobs[last], sizeof(struct job));
+        for (size_t k = 0; k < j->nprocs; k++) {
+            if (j->pids[k] > 0 && (slot = find_job_slot(j->pids[k])) != NULL) {
+                slot->job = i + 1; // Point its index slots at the new position
+            }
+        }
+    }
+    child_jobs->len -= 1; // Decrement the number of jobs
+    // No names are referenced anymore, recycle their memory
+    if (child_jobs->len == 0) {
+        arena_reset(&child_jobs->names);
+        child_jobs->names_dead = 0;
+        child_jobs->next_id = 1;
+    } else if (child_jobs->names_dead > JOB_NAMES_DEAD_MAX && child_jobs->names_dead > child_jobs->names_live) {
+        compact_job_names(); // A long-lived job keeps the table from emptying, copying it costs less
+    }
+}
+
+// Function to remove a job by the PID of one of its running processes
+void free_job_by_pid(pid_t pid) {
+    struct job_slot *slot = find_job_slot(pid);
+    if (slot != NULL) {
+        free_job(slot->job - 1);
+    }
+}
+
+// Function to find a job by the PID of one of its running processes
+struct job *find_job_by_pid(pid_t pid) {
+    struct job_slot *slot = find_job_slot(pid);
+    if (slot != NULL) {
+        return &child_jobs->jobs[slot->job - 1]; // Return the found job
+    }
+    return NULL; // Return NULL if the job was not found
+}
+
+// Function to add a job to the list
+void add_job(const struct job *j) {
+    if (child_jobs == NULL) {
+        // Allocate initial memory for the child_jobs structure
+        child_jobs = malloc(sizeof(struct child_jobs) + 4 * sizeof(struct job));
+        child_jobs->len = 0;
+        child_jobs->cap = 4;
+        child_jobs->index = NULL;
+        child_jobs->names.chunks = NULL;
+        child_jobs->names_live = child_jobs->names_dead = 0;
+        child_jobs->next_id = 1;
+        rebuild_job_index(8);
+    }
+
+    size_t len = child_jobs->len, cap = child_jobs->cap;
+    
+    // Expand the jobs array if necessary, doubling it keeps reallocs rare on fan-out
+    if (len >= cap) {
+        child_jobs = realloc(child_jobs, sizeof(struct child_jobs) + sizeof(struct job) * cap * 2);
+        child_jobs->cap = cap * 2; // Increase the capacity
+    }
+    
+    struct job *new_job = &child_jobs->jobs[len]; // Pointer to the new job
+    *new_job = *j;                                // Copy PIDs and status
+    move_job_names(new_job, &child_jobs->names);  // Copy the job's name into the name arena
+    child_jobs->names_live += job_names_size(new_job);
+    // A job coming back from the foreground keeps its number
+    if (j->id == 0) {
+        new_job->id = child_jobs->next_id++;
+    } else {
+        child_jobs->next_id = MAX(child_jobs->next_id, j->id + 1);
+    }
+
+    child_jobs->len += 1; // Increment the number of jobs
+
+    // Keep the index at most half full so probe sequences stay short
+    if ((child_jobs->index_used + j->nprocs) * 2 > child_jobs->index_mask + 1) {
+        size_t slots = child_jobs->index_mask + 1;
+        while ((child_jobs->index_used + j->nprocs) * 2 > slots) {
+            slots *= 2;
+        }
+        rebuild_job_index(slots);
+    } else {
+        for (size_t k = 0; k < j->nprocs; k++) {
+            if (j->pids[k] > 0) {
+                insert_job_slot(j->pids[k], len); // A stopped job may have reaped processes
+            }
+        }
+    }
+}
+
+// Function to record that a process of a job has been reaped
+// ru is the process's resource usage from wait4(), when the time it was reaped
+void job_process_exited(struct job *j, pid_t pid, int status, const struct rusage *ru, uint64_t when) {
+    struct job_usage *u = &j->usage;
+    timeradd(&u->utime, &ru->ru_utime, &u->utime);
+    timeradd(&u->stime, &ru->ru_stime, &u->stime);
+    u->maxrss = MAX(u->maxrss, ru->ru_maxrss);
+    u->nvcsw += ru->ru_nvcsw;
+    u->nivcsw += ru->ru_nivcsw;
+    for (size_t k = 0; k < j->nprocs; k++) {
+        if (j->pids[k] == pid) {
+            j->pids[k] = -pid; // Keep the PID for reports but mark it reaped
+            j->nstopped -= j->stopped[k]; // A stopped process can still be killed
+            j->stopped[k] = 0;
+        }
+    }
+    if (pid == j->status_pid) {
+        j->status = status; // A pipeline's status is the status of its last stage
+    }
+    if (--j->running == 0) {
+        u->end_ns = when;
+        j->finished = 1; // Reported later by report_finished_jobs()
+    }
+}
+
+// Function to record that a process of a job was stopped or continued by a signal
+// The job is reported when all of its processes have stopped, and when the first resumes
+void job_process_stopped(struct job *j, pid_t pid, int status) {
+    int stop = WIFSTOPPED(status);
+    for (size_t k = 0; k < j->nprocs; k++) {
+        if (j->pids[k] == pid && j->stopped[k] != stop) {
+            j->stopped[k] = stop;
+            j->nstopped += stop ? 1 : -1;
+            if (stop ? j->nstopped == j->running : j->nstopped + 1 == j->running) {
+                j->state_status = status;
+                j->notify = 1;
+            }
+        }
+    }
+}
+
+// Function to check whether every process of a job that is still running is stopped
+int job_is_stopped(const struct job *j) {
+    return !j->finished && j->nstopped == j->running;
+}
+
+// Function to send a signal to every process of a job that hasn't been reaped
+// A job in its own process group takes a single killpg(); a stopped job is continued
+// afterwards so it acts on the signal, and counts as running from then on
+int signal_job(struct job *j, int sig) {
+    int ret = 0;
+    if (j->pgid > 0) {
+        ret = killpg(j->pgid, sig);
+    } else {
+        for (size_t k = 0; k < j->nprocs; k++) {
+            if (j->pids[k] > 0 && kill(j->pids[k], sig) < 0) {
+                ret = -1; // Reaped processes are stored negated
+            }
+        }
+    }
+    if (sig == SIGCONT) {
+        memset(j->stopped, 0, j->nprocs);
+        j->nstopped = 0;
+    } else if (j->nstopped > 0 && sig != SIGSTOP && sig != SIGTSTP && sig != SIGTTIN && sig != SIGTTOU) {
+        signal_job(j, SIGCONT);
+    }
+    return ret;
+}
+
+// Function to free all jobs, releasing memory resources
+void free_jobs(void) {
+    if (child_jobs != NULL) {
+        arena_free(&child_jobs->names); // Free every job's name memory at once
+        free(child_jobs->index); // Free the PID index
+    }
+    free(child_jobs); // Free the entire job list structure
+    child_jobs = NULL; // Set the global pointer to NULL for safety
+}
+
+// Structure to store a redirection of one of a command's file descriptors
+struct redirect {
+    int fd;                 // Descriptor of the command that is redirected
+    int flags;              // open() flags for target
+    char *target;           // File to open, NULL when duplicating dup_fd (N>&M)
+    int dup_fd;             // Descriptor to duplicate when target is NULL
+    int open_fd;            // Shell's descriptor for the opened target while launching, or -1
+    size_t stage;           // Pipeline stage the redirection belongs to, used while parsing
+    struct redirect *next;  // Next redirection of the command, applied in order
+};
+
+// Structure to store command details
+struct command {
+    char *cmd;    // Command name, points at argv[0]
+    char **argv;  // Argument vector, including command as first argument
+    struct redirect *redirs; // Redirections, NULL if there are none
+    char **assigns;     // "NAME=value" words in front of the command, set when it is expanded
+    size_t num_assigns; // Number of assigns
+    char **envp;        // Environment with assigns put in, NULL to use environ
+};
+
+// Structure to store where a job's processes run and take their memory from
+struct placement {
+    int has_cpus;       // Set when the processes are restricted to cpus
+    cpu_set_t cpus;     // CPUs the processes may run on
+    int node;           // NUMA node to allocate memory on, or -1 to leave the policy alone
+    int mem_mode;       // MPOL_BIND or MPOL_PREFERRED for node
+    struct cgroup_limit *limits; // Limits of a cgroup created for the job, NULL for none
+    int procs_fd;       // cgroup.procs of the job's cgroup while it launches, or -1
+};
+
+// Resource limit of a job's cgroup, a line written to one of its cgroup v2 interface files
+struct cgroup_limit {
+    const char *file;           // Interface file: cpu.max, memory.max or io.max
+    char *value;                // Line written to it
+    struct cgroup_limit *next;  // Next limit of the job, in command line order
+};
+
+// Function to parse a list of numbers and ranges like "0-3,8,10-11" into a set
+// Returns -1 if the list is malformed or names a number the set can't hold
+int parse_cpu_list(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s != '\0' && *s != '\n') {
+        char *end;
+        long first = strtol(s, &end, 10), last = first;
+        if (end == s || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        s = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0' && *end != '\n') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to read a sysfs file holding a list in the format parse_cpu_list() takes
+int read_cpu_list(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return parse_cpu_list(buf, set);
+}
+
+// NUMA topology of the machine, read from sysfs the first time it is needed
+struct numa_topology {
+    int loaded;             // Set once sysfs has been read
+    int nodes;              // Highest online node + 1, 0 without NUMA information
+    cpu_set_t online;       // Online nodes, as a bitmap of node numbers
+    cpu_set_t *node_cpus;   // CPUs of each node
+} numa = { 0 };
+
+// Function to read the online NUMA nodes and their CPUs
+void load_numa_topology(void) {
+    char path[64];
+
+    if (numa.loaded) {
+        return;
+    }
+    numa.loaded = 1;
+    if (read_cpu_list("/sys/devices/system/node/online", &numa.online) < 0) {
+        return; // No NUMA support, nothing can be placed on a node
+    }
+    for (int n = 0; n < CPU_SETSIZE; n++) {
+        if (CPU_ISSET(n, &numa.online)) {
+            numa.nodes = n + 1;
+        }
+    }
+    numa.node_cpus = calloc(numa.nodes, sizeof(cpu_set_t));
+    for (int n = 0; n < numa.nodes; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if (CPU_ISSET(n, &numa.online) && read_cpu_list(path, &numa.node_cpus[n]) < 0) {
+            CPU_CLR(n, &numa.online); // Went away or unreadable, don't place anything there
+        }
+    }
+}
+
+// Function to find the NUMA node a CPU belongs to, -1 if it is unknown
+int cpu_node(int cpu) {
+    load_numa_topology();
+    for (int n = 0; n < numa.nodes; n++) {
+        if (CPU_ISSET(n, &numa.online) && CPU_ISSET(cpu, &numa.node_cpus[n])) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+// Function to release the NUMA topology
+void free_numa_topology(void) {
+    free(numa.node_cpus);
+    memset(&numa, 0, sizeof(numa));
+}
+
+// Enumeration for how a pipeline is joined to the one after it on a command line
+enum list_op {
+    LIST_END,   // Last pipeline of the line
+    LIST_SEQ,   // ';' or '&': the next pipeline runs regardless
+    LIST_AND,   // '&&': the next pipeline runs if this one succeeded
+    LIST_OR     // '||': the next pipeline runs if this one failed
+};
+
+// Structure to store the commands of a pipeline
+struct pipeline {
+    size_t len;                 // Number of stages
+    struct placement *place;    // Where the job's processes run, NULL to inherit the shell's
+    int timed;                  // Set by a time prefix: report where the line's time went
+    int background;             // Set when the and-or list this pipeline is in was ended by '&'
+    int has_vars;               // Set when an argument or redirection has a '$' to expand
+    enum list_op op;            // How the next pipeline of the line is run
+    struct pipeline *next;      // Next pipeline of the line, NULL for the last one
+    struct command stages[];    // Stages, the output of each one is the input of the next
+};
+
+// Enumeration to identify the type of command parsed
+enum command_type {
+    FAIL,        // Parsing failed
+    SPACES,      // Command contains only spaces
+    FOREGROUND,  // Foreground execution command
+    BACKGROUND   // Background execution command
+};
+
+// Classes of input bytes as seen by the tokenizer
+enum char_class {
+    CC_BAD,      // Neither printable nor whitespace
+    CC_WORD,     // Part of an argument
+    CC_SPACE,    // Separates arguments
+    CC_AMP,      // Background execution symbol '&'
+    CC_PIPE,     // Pipe symbol '|'
+    CC_SEMI,     // Command separator ';'
+    CC_LESS,     // Input redirection symbol '<'
+    CC_GREATER,  // Output redirection symbol '>'
+    CC_DOLLAR    // Variable reference '$', kept in the argument it appears in
+};
+
+// Class of every byte value, the same split isprint()/isspace() make in the C locale
+// Every byte that isn't CC_WORD must also be found by the vector scanners below
+const unsigned char char_classes[256] = {
+    ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE, ['\r'] = CC_SPACE, [' '] = CC_SPACE,
+    ['!' ... '~'] = CC_WORD, ['&'] = CC_AMP, ['|'] = CC_PIPE,
+    ['<'] = CC_LESS, ['>'] = CC_GREATER, [';'] = CC_SEMI, ['$'] = CC_DOLLAR,
 };
 
-// List structure to keep track of all child jobs
-struct child_jobs {
-    size_t len;         // Number of jobs currently running or not cleared
-    size_t cap;         // Capacity - maximum number of jobs that can be stored
-    struct job jobs[];  // Flexible array member to hold the jobs
-} *child_jobs = NULL;   // Global pointer to the list of child jobs
+// Function to find the first byte that ends an argument, one byte at a time
+// Returns n if all n bytes belong to arguments
+size_t scan_word_scalar(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && char_classes[(unsigned char) p[i]] == CC_WORD) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Function to find the first byte that ends an argument, 16 bytes at a time
+__attribute__((target("sse2")))
+size_t scan_word_sse2(const char *p, size_t n) {
+    const __m128i low = _mm_set1_epi8('!'), span = _mm_set1_epi8('~' - '!');
+    const __m128i amp = _mm_set1_epi8('&'), bar = _mm_set1_epi8('|');
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), semi = _mm_set1_epi8(';');
+    const __m128i dollar = _mm_set1_epi8('$');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        // A byte is part of an argument if it is in '!'..'~' and isn't an operator
+        __m128i off = _mm_sub_epi8(v, low);
+        __m128i word = _mm_cmpeq_epi8(_mm_min_epu8(off, span), off);
+        __m128i op = _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, bar));
+        op = _mm_or_si128(op, _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+        op = _mm_or_si128(op, _mm_or_si128(_mm_cmpeq_epi8(v, semi), _mm_cmpeq_epi8(v, dollar)));
+        word = _mm_andnot_si128(op, word);
+        unsigned mask = ~_mm_movemask_epi8(word) & 0xFFFF;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_word_scalar(p + i, n - i); // Fewer than 16 bytes left
+}
+
+// Function to find the first byte that ends an argument, 32 bytes at a time
+__attribute__((target("avx2")))
+size_t scan_word_avx2(const char *p, size_t n) {
+    const __m256i low = _mm256_set1_epi8('!'), span = _mm256_set1_epi8('~' - '!');
+    const __m256i amp = _mm256_set1_epi8('&'), bar = _mm256_set1_epi8('|');
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'), semi = _mm256_set1_epi8(';');
+    const __m256i dollar = _mm256_set1_epi8('$');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        // Same test as the SSE2 version on twice the bytes
+        __m256i off = _mm256_sub_epi8(v, low);
+        __m256i word = _mm256_cmpeq_epi8(_mm256_min_epu8(off, span), off);
+        __m256i op = _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, bar));
+        op = _mm256_or_si256(op, _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)));
+        op = _mm256_or_si256(op, _mm256_or_si256(_mm256_cmpeq_epi8(v, semi), _mm256_cmpeq_epi8(v, dollar)));
+        word = _mm256_andnot_si256(op, word);
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(word);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_word_sse2(p + i, n - i); // Fewer than 32 bytes left
+}
+#endif
+
+// Scanner used by gen_pipeline(), the fastest one this CPU supports
+size_t (*scan_word)(const char *p, size_t n) = scan_word_scalar;
+
+// Function to pick the line scanner at startup
+void init_scanner(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_word = scan_word_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_word = scan_word_sse2;
+    }
+#endif
+}
+
+// Arena holding the structures of the command being executed, reset after each command
+struct arena command_arena = { NULL };
+
+// Function to release the structures of the command line parsed last, all of them in the arena
+void reset_command_arena(void) {
+    arena_reset(&command_arena); // Arguments live in the input line, the structures in the arena
+}
+
+// Function to tell whether an argument vector starts with a placement prefix
+// cpus and node are real command names too ("node app.js" runs Node.js), so they only start a prefix
+// when a CPU list or node number and a command follow
+int is_placement_prefix(char **argv) {
+    const char *digits;
+
+    if (!strcmp(argv[0], "cpu.max") || !strcmp(argv[0], "memory.max") || !strcmp(argv[0], "io.max")) {
+        return 1;
+    } else if (!strcmp(argv[0], "cpus")) {
+        digits = "0123456789,-";
+    } else if (!strcmp(argv[0], "node")) {
+        digits = "0123456789";
+    } else {
+        return 0;
+    }
+    return argv[1] != NULL && argv[2] != NULL && argv[1][0] != '\0' && argv[1][strspn(argv[1], digits)] == '\0';
+}
+
+// Function to strip "cpus LIST" and "node N" prefixes off a pipeline's first command
+// They place every process of the job, the pipeline's placement is allocated from the arena
+// Returns -1 after reporting a prefix that names no usable CPUs or node
+int take_placement(struct pipeline *p, struct arena *a) {
+    struct command *c = &p->stages[0];
+    struct cgroup_limit **tail = NULL;
+
+    while (c->argv[0] != NULL && is_placement_prefix(c->argv)) {
+        struct placement *pl = p->place;
+        if (c->argv[1] == NULL || c->argv[2] == NULL) {
+            fprintf(stderr, "%s: missing argument or command\n", c->argv[0]);
+            return -1;
+        }
+        if (pl == NULL) {
+            pl = p->place = arena_alloc(a, sizeof(struct placement));
+            pl->has_cpus = 0;
+            pl->node = -1;
+            pl->mem_mode = MPOL_DEFAULT;
+            pl->limits = NULL;
+            pl->procs_fd = -1;
+            tail = &pl->limits;
+        }
+        if (strchr(c->argv[0], '.') != NULL) {
+            // A cgroup limit, with ',' standing for the spaces of lines like "8:0 rbps=1048576"
+            struct cgroup_limit *l = arena_alloc(a, sizeof(struct cgroup_limit));
+            for (char *q = c->argv[1]; (q = strchr(q, ',')) != NULL; ) {
+                *q = ' ';
+            }
+            l->file = c->argv[0];
+            l->value = c->argv[1];
+            l->next = NULL;
+            *tail = l;
+            tail = &l->next;
+        } else if (!strcmp(c->argv[0], "cpus")) {
+            cpu_set_t online;
+            int bad = parse_cpu_list(c->argv[1], &pl->cpus) < 0 || CPU_COUNT(&pl->cpus) == 0;
+            // sched_setaffinity() in the child would fail on a list without online CPUs
+            if (!bad && read_cpu_list("/sys/devices/system/cpu/online", &online) == 0) {
+                CPU_AND(&online, &online, &pl->cpus);
+                bad = CPU_COUNT(&online) == 0;
+            }
+            if (bad) {
+                fprintf(stderr, "cpus: invalid CPU list %s\n", c->argv[1]);
+                return -1;
+            }
+            pl->has_cpus = 1;
+        } else {
+            char *end;
+            long node = strtol(c->argv[1], &end, 10);
+            load_numa_topology();
+            if (*end != '\0' || node < 0 || node >= numa.nodes || !CPU_ISSET(node, &numa.online)) {
+                fprintf(stderr, "node: no online NUMA node %s\n", c->argv[1]);
+                return -1;
+            }
+            // Run on the node's CPUs unless cpus picked some, and keep memory on the node
+            if (!pl->has_cpus) {
+                pl->cpus = numa.node_cpus[node];
+                pl->has_cpus = 1;
+            }
+            pl->node = node;
+            pl->mem_mode = MPOL_BIND;
+        }
+        c->argv += 2;
+        c->cmd = c->argv[0];
+    }
+    return 0;
+}
+
+// Function to build a pipeline out of num_stages NULL-terminated argument vectors at argv
+// and hand each of its redirections to its stage, keeping their order
+// Returns NULL after reporting a bad prefix
+struct pipeline *finish_pipeline(char **argv, size_t num_stages, struct redirect *redirs) {
+    struct pipeline *p = arena_alloc(&command_arena, sizeof(struct pipeline) + sizeof(struct command) * num_stages);
+    struct redirect *r;
+
+    p->len = num_stages;
+    p->place = NULL;
+    p->timed = 0;
+    p->background = 0;
+    p->has_vars = 0;
+    p->op = LIST_END;
+    p->next = NULL;
+    // Point each stage at its part of argv
+    for (size_t s = 0, k = 0; s < num_stages; s++) {
+        p->stages[s].argv = &argv[k];
+        p->stages[s].cmd = argv[k]; // Setting command name for the first argument
+        p->stages[s].redirs = NULL;
+        p->stages[s].assigns = NULL;
+        p->stages[s].num_assigns = 0;
+        p->stages[s].envp = NULL;
+        while (argv[k] != NULL) {
+            k++;
+        }
+        k++; // Skip the NULL ending this stage
+    }
+    for (r = redirs; r != NULL; r = redirs) {
+        struct redirect **tail = &p->stages[r->stage].redirs;
+        redirs = r->next;
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+        r->next = NULL;
+        *tail = r;
+    }
+
+    // time in front of everything else asks for the phase breakdown
+    if (!strcmp(p->stages[0].cmd, "time") && p->stages[0].argv[1] != NULL) {
+        p->timed = 1;
+        p->stages[0].argv++;
+        p->stages[0].cmd = p->stages[0].argv[0];
+    }
+    if (take_placement(p, &command_arena) < 0) {
+        return NULL;
+    }
+    return p;
+}
+
+// Function to generate the pipelines of a command line based on the user input
+// Pipelines are separated by ';', '&', '&&' and '||' and linked in order from *p
+// Arguments are split in place: separators in line are overwritten with NUL
+// and argv points into line, so it must outlive the pipelines
+// Returns how the first pipeline runs, or FAIL/SPACES
+enum command_type gen_pipeline(char *line, ssize_t len, struct pipeline **p) {
+    size_t num_args = 0, first_arg = 0, num_stages = 1, stage_args = 0, i = 0, start;
+    struct redirect *redirs = NULL, **redir_tail = &redirs, *pending = NULL, *r;
+    struct pipeline **tail = p, *last = NULL, *list_start = NULL;
+    int is_background, has_vars = 0, is_arg;
+    enum list_op op;
+    char **argv;
+
+    // Every argument and operator takes at least one byte, and each stage ends in one NULL
+    argv = arena_alloc(&command_arena, sizeof(char *) * (len + 2));
+    *p = NULL;
+
+    // Single pass: skip over runs of argument bytes and handle the byte that ends each run
+    while (i < (size_t) len) {
+        start = i;
+        i += scan_word(&line[i], len - i);
+        // A '$' stays in its argument and is only noted here, the reference is expanded right
+        // before the command runs so that it sees assignments made earlier on the line
+        while (i < (size_t) len && line[i] == '$') {
+            has_vars = 1;
+            i++;
+            i += scan_word(&line[i], len - i);
+        }
+        is_arg = 0;
+        if (i > start && pending != NULL) {
+            pending->target = &line[start]; // The word after '<' or '>' names the file
+            pending = NULL;
+        } else if (i > start) {
+            argv[num_args++] = &line[start]; // Start of a new argument
+            stage_args++;
+            is_arg = 1;
+        }
+        if (i == (size_t) len) {
+            break;
+        }
+        op = LIST_END;
+        is_background = 0;
+        switch (char_classes[(unsigned char) line[i++]]) {
+            case CC_SPACE:
+                line[i - 1] = '\0'; // End the argument in place
+                break;
+            case CC_AMP:
+                line[i - 1] = '\0';
+                if (i < (size_t) len && line[i] == '&') {
+                    op = LIST_AND; // && runs the next pipeline if this one succeeded
+                    i++;
+                } else {
+                    op = LIST_SEQ; // & runs what came before in the background
+                    is_background = 1;
+                }
+                break;
+            case CC_SEMI:
+                line[i - 1] = '\0';
+                op = LIST_SEQ;
+                break;
+            case CC_LESS:
+            case CC_GREATER:
+                if (pending != NULL) {
+                    reset_command_arena(); // A redirection needs a file name
+                    return FAIL;
+                }
+                r = arena_alloc(&command_arena, sizeof(struct redirect));
+                r->fd = line[i - 1] == '<' ? STDIN_FILENO : STDOUT_FILENO;
+                r->flags = line[i - 1] == '<' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+                r->target = NULL;
+                r->dup_fd = -1;
+                r->open_fd = -1;
+                r->stage = num_stages - 1;
+                r->next = NULL;
+                // A single digit argument right before the operator names the descriptor, as in 2>
+                // A digit that is the file of an earlier redirection, as in <2>f, stays a file name
+                if (is_arg && i - 1 - start == 1 && line[start] >= '0' && line[start] <= '9') {
+                    r->fd = line[start] - '0';
+                    num_args--;
+                    stage_args--;
+                }
+                line[i - 1] = '\0'; // End the argument before the operator
+                if (r->flags != O_RDONLY && i < (size_t) len && line[i] == '>') {
+                    r->flags = O_WRONLY | O_CREAT | O_APPEND; // >> appends
+                    i++;
+                }
+                if (i + 1 < (size_t) len && line[i] == '&' && line[i + 1] >= '0' && line[i + 1] <= '9') {
+                    r->dup_fd = line[i + 1] - '0'; // N>&M duplicates descriptor M
+                    i += 2;
+                } else {
+                    pending = r; // The next word is the file
+                }
+                *redir_tail = r;
+                redir_tail = &r->next;
+                break;
+            case CC_PIPE:
+                line[i - 1] = '\0';
+                if (i < (size_t) len && line[i] == '|') {
+                    op = LIST_OR; // || runs the next pipeline if this one failed
+                    i++;
+                    break;
+                }
+                if (stage_args == 0 || pending != NULL) {
+                    reset_command_arena(); // A pipe needs a command on both sides
+                    return FAIL;
+                }
+                argv[num_args++] = NULL; // End the stage's argument vector
+                num_stages++;
+                stage_args = 0;
+                break;
+            default:
+                reset_command_arena(); // Fail on non-printable/non-space characters
+                return FAIL;
+        }
+        if (op == LIST_END) {
+            continue;
+        }
+
+        // A list operator ends the pipeline, which needs a command
+        if (stage_args == 0 || pending != NULL) {
+            reset_command_arena();
+            return FAIL;
+        }
+        argv[num_args++] = NULL;
+        if ((last = *tail = finish_pipeline(&argv[first_arg], num_stages, redirs)) == NULL) {
+            reset_command_arena();
+            return FAIL;
+        }
+        last->op = op;
+        last->has_vars = has_vars;
+        has_vars = 0;
+        // '&' sends the whole and-or list it ends to the background
+        if (list_start == NULL) {
+            list_start = last;
+        }
+        for (struct pipeline *q = list_start; is_background && q != NULL; q = q->next) {
+            q->background = 1;
+        }
+        if (op != LIST_AND && op != LIST_OR) {
+            list_start = NULL;
+        }
+        tail = &last->next;
+        first_arg = num_args;
+        num_stages = 1;
+        stage_args = 0;
+        redirs = NULL;
+        redir_tail = &redirs;
+    }
+    // getline() NUL-terminates the buffer, so a final argument is already terminated
+
+    if (num_args == first_arg && num_stages == 1 && redirs == NULL) {
+        if (last == NULL) {
+            reset_command_arena();
+            return SPACES; // No arguments, only spaces
+        }
+        if (last->op != LIST_SEQ) {
+            reset_command_arena(); // Nothing after the last '&&' or '||'
+            return FAIL;
+        }
+        last->op = LIST_END; // A final ';' or '&' ends the line
+        return (*p)->background ? BACKGROUND : FOREGROUND;
+    }
+    if (stage_args == 0 || pending != NULL) {
+        reset_command_arena(); // Nothing after the last '|', '<' or '>'
+        return FAIL;
+    }
+    argv[num_args] = NULL; // Null-terminate the last argument vector
+    if ((*tail = finish_pipeline(&argv[first_arg], num_stages, redirs)) == NULL) {
+        reset_command_arena();
+        return FAIL;
+    }
+    (*tail)->has_vars = has_vars;
+
+    return (*p)->background ? BACKGROUND : FOREGROUND; // Return command type
+}
+
+// Shell option that can be switched with the set builtin
+struct shell_option {
+    const char *name;   // Name used with set -o/+o
+    int value;          // Non-zero when the option is on
+};
+
+// Enumeration indexing the shell options
+enum option_id {
+    OPT_FORKEXEC,       // Launch every command with fork+execvp instead of posix_spawnp
+    OPT_BIGPIPE,        // Give pipes and named pipe redirection targets a large buffer
+    OPT_ODIRECT,        // Open redirection targets with O_DIRECT
+    OPT_SPREAD,         // Place background jobs on the shell's CPUs in turn
+    OPT_RUSAGE,         // Add resource usage to job status reports
+    OPT_MONITOR,        // Run every job in a process group of its own
+    OPT_NOGLOB,         // Pass arguments with wildcards to commands as they are
+    OPT_STATS,          // Print the hot-path statistics when the shell exits, off so output stays as it was
+    NUM_OPTIONS
+};
+
+// All shell options and their current values
+struct shell_option options[NUM_OPTIONS] = {
+    [OPT_FORKEXEC] = { "forkexec", 0 },
+    [OPT_BIGPIPE]  = { "bigpipe", 0 },
+    [OPT_ODIRECT]  = { "odirect", 0 },
+    [OPT_SPREAD]   = { "spread", 0 },
+    [OPT_RUSAGE]   = { "rusage", 0 },
+    [OPT_MONITOR]  = { "monitor", 0 },  // Switched on for interactive shells in main()
+    [OPT_NOGLOB]   = { "noglob", 0 },
+    [OPT_STATS]    = { "stats", 0 },
+};
+
+// Terminal the shell hands to foreground jobs, -1 without job control
+int shell_terminal = -1;
+// Process group of the shell, it takes the terminal back after a foreground job
+pid_t shell_pgid = 0;
+// Terminal modes of the shell, restored when a foreground job stopped or was killed
+struct termios shell_tmodes;
+// Signal mask the shell started with, children are launched with it
+sigset_t shell_sigmask;
+// Signals the shell ignores while it controls a terminal, jobs get their default actions back
+const int job_control_signals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+#define NUM_JOB_CONTROL_SIGNALS (sizeof(job_control_signals) / sizeof(job_control_signals[0]))
+
+// Function to give a copy of the shell the default actions of the signals job control ignores
+void default_job_signals(void) {
+    for (size_t i = 0; i < NUM_JOB_CONTROL_SIGNALS; i++) {
+        signal(job_control_signals[i], SIG_DFL);
+    }
+}
+
+// Enumeration for the ways an external command can be launched
+enum launch_path {
+    LAUNCH_SPAWN,       // posix_spawnp(), no copy of the shell's address space
+    LAUNCH_FORK,        // fork() followed by execvp() in the child
+    NUM_LAUNCH_PATHS
+};
+
+// Latency statistics for one launch path, measured until the command is executing
+struct spawn_stats {
+    const char *name;   // Name printed by spawnstat
+    size_t count;       // Number of successful launches
+    uint64_t total_ns;  // Sum of all launch latencies
+    uint64_t min_ns;    // Fastest launch
+    uint64_t max_ns;    // Slowest launch
+} spawn_stats[NUM_LAUNCH_PATHS] = {
+    [LAUNCH_SPAWN] = { "posix_spawn", 0, 0, UINT64_MAX, 0 },
+    [LAUNCH_FORK]  = { "fork+exec",   0, 0, UINT64_MAX, 0 },
+};
+
+// Function to read the monotonic clock in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Time spent in each phase of running the current command line, reported by the time prefix
+struct phase_times {
+    uint64_t start_ns;      // When the line was read
+    uint64_t parse_ns;      // Tokenizing it into a pipeline
+    uint64_t lookup_ns;     // Finding the commands in the PATH cache or PATH
+    uint64_t spawn_ns;      // Creating the processes, posix_spawn also covers exec
+    uint64_t exec_ns;       // From fork() returning until the child's exec succeeded
+    uint64_t builtin_ns;    // Running a builtin in the shell
+    uint64_t wait_ns;       // Waiting for the job to finish
+} phases;
+
+// Function to print what a job's cgroup used, read when its last process was reaped
+// CPU time includes every descendant, also ones the shell never saw
+void print_cgroup_usage(FILE *out, const struct job_usage *u) {
+    fprintf(out, "cgroup cpu %.3fs", u->cg_usage_usec / 1e6);
+    if (u->cg_peak >= 0) {
+        fprintf(out, " peak %ldk", u->cg_peak);
+    }
+    fprintf(out, " io %lluk/%lluk", (unsigned long long) u->cg_rbytes / 1024, (unsigned long long) u->cg_wbytes / 1024);
+}
+
+// Function to print the resources a job used, wall time counts up to now while it runs
+void print_usage(FILE *out, const struct job_usage *u) {
+    uint64_t end = u->end_ns ? u->end_ns : now_ns();
+    fprintf(out, "real %.3fs user %ld.%03lds sys %ld.%03lds maxrss %ldk csw %ld/%ld",
+            (end - u->start_ns) / 1e9,
+            (long) u->utime.tv_sec, (long) u->utime.tv_usec / 1000,
+            (long) u->stime.tv_sec, (long) u->stime.tv_usec / 1000,
+            u->maxrss, u->nvcsw, u->nivcsw);
+    if (u->cgroup) {
+        fprintf(out, " ");
+        print_cgroup_usage(out, u);
+    }
+}
+
+// Cached location of an external command
+struct path_entry {
+    char *name;         // Command name as typed, NULL if the slot is empty
+    char *path;         // Absolute path found in PATH
+    uint32_t hash;      // Hash of name
+    unsigned hits;      // Number of times the entry was used
+};
+
+// Command name to absolute path cache, consulted before every launch
+struct path_cache {
+    struct path_entry *slots;   // Open-addressing table, a power of two in size
+    size_t mask;                // Number of slots minus one
+    size_t count;               // Number of occupied slots
+    char *path_env;             // Value of PATH the entries were resolved against
+    struct arena strings;       // Storage for names and paths, released by clear_path_cache()
+} path_cache = { NULL, 0, 0, NULL, { NULL } };
+
+// Function to hash a command name (FNV-1a)
+uint32_t hash_command_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    }
+    return h;
+}
+
+// Function to forget every cached command location
+void clear_path_cache(void) {
+    free(path_cache.slots);
+    path_cache.slots = NULL;
+    path_cache.mask = 0;
+    path_cache.count = 0;
+    arena_reset(&path_cache.strings);
+}
+
+// Function to find the slot of a cached command, or the empty slot where it belongs
+struct path_entry *find_path_slot(const char *name, uint32_t hash) {
+    size_t i = hash & path_cache.mask;
+    while (path_cache.slots[i].name != NULL &&
+           (path_cache.slots[i].hash != hash || strcmp(path_cache.slots[i].name, name))) {
+        i = (i + 1) & path_cache.mask; // Linear probing
+    }
+    return &path_cache.slots[i];
+}
+
+// Function to remember where a command lives
+struct path_entry *insert_path_entry(const char *name, const char *path) {
+    // Keep the table at most half full, doubling it when needed
+    if (path_cache.slots == NULL || (path_cache.count + 1) * 2 > path_cache.mask + 1) {
+        struct path_entry *old = path_cache.slots;
+        size_t old_size = old ? path_cache.mask + 1 : 0;
+        path_cache.mask = old ? old_size * 2 - 1 : 31;
+        path_cache.slots = calloc(path_cache.mask + 1, sizeof(struct path_entry));
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].name != NULL) {
+                *find_path_slot(old[i].name, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+    uint32_t hash = hash_command_name(name);
+    struct path_entry *e = find_path_slot(name, hash);
+    if (e->name == NULL) {
+        e->name = arena_strdup(&path_cache.strings, name);
+        e->hash = hash;
+        e->hits = 0;
+        path_cache.count++;
+    }
+    e->path = arena_strdup(&path_cache.strings, path);
+    return e;
+}
+
+// Function to drop a cached command, shifting later entries back so no tombstones are needed
+void remove_path_entry(const char *name) {
+    if (path_cache.slots == NULL) {
+        return;
+    }
+    struct path_entry *e = find_path_slot(name, hash_command_name(name));
+    if (e->name == NULL) {
+        return; // Not cached
+    }
+    size_t mask = path_cache.mask, hole = e - path_cache.slots;
+    for (size_t i = (hole + 1) & mask; path_cache.slots[i].name != NULL; i = (i + 1) & mask) {
+        size_t home = path_cache.slots[i].hash & mask;
+        // Move the entry into the hole unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            path_cache.slots[hole] = path_cache.slots[i];
+            hole = i;
+        }
+    }
+    path_cache.slots[hole].name = NULL;
+    path_cache.count--;
+}
+
+// Function to search PATH for an executable the way execvp() does
+// Returns buf filled with the absolute path, or NULL if the command wasn't found
+char *search_path(const char *name, char *buf, size_t size) {
+    const char *dirs = path_cache.path_env, *end;
+    struct stat st;
+    for (; ; dirs = end + 1) {
+        end = strchrnul(dirs, ':');
+        // An empty PATH entry means the current directory
+        int n = end == dirs ? snprintf(buf, size, "%s", name)
+                            : snprintf(buf, size, "%.*s/%s", (int) (end - dirs), dirs, name);
+        if (n > 0 && (size_t) n < size && access(buf, X_OK) == 0 && stat(buf, &st) == 0 && S_ISREG(st.st_mode)) {
+            return buf;
+        }
+        if (*end == '\0') {
+            return NULL;
+        }
+    }
+}
+
+// Function to check that the cache was built for the current PATH, clearing it otherwise
+void validate_path_cache(void) {
+    const char *env = getenv("PATH");
+    if (env == NULL) {
+        env = "/bin:/usr/bin"; // execvp()'s default search path
+    }
+    if (path_cache.path_env == NULL || strcmp(path_cache.path_env, env)) {
+        clear_path_cache();
+        free(path_cache.path_env);
+        path_cache.path_env = strdup(env);
+    }
+}
+
+// Function to look up a command in the cache, searching PATH on a miss
+// Names containing a slash are used as they are, NULL means the command wasn't found
+const char *resolve_command(const char *name, int *cached) {
+    char buf[MAXPATHLEN];
+    struct path_entry *e;
+
+    *cached = 0;
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    validate_path_cache();
+    if (path_cache.slots != NULL && (e = find_path_slot(name, hash_command_name(name)))->name != NULL) {
+        *cached = 1;
+    } else if (search_path(name, buf, sizeof(buf)) != NULL) {
+        e = insert_path_entry(name, buf);
+    } else {
+        return NULL;
+    }
+    e->hits++;
+    return e->path;
+}
+
+// Function to free the command location cache at exit
+void free_path_cache(void) {
+    clear_path_cache();
+    arena_free(&path_cache.strings);
+    free(path_cache.path_env);
+    path_cache.path_env = NULL;
+}
+
+// Shell variable, exported ones are in the environment of every command
+struct variable {
+    char *entry;        // "NAME=value", NULL if the slot is empty
+    size_t name_len;    // Length of NAME
+    uint32_t hash;      // Hash of NAME
+    int exported;       // Non-zero if the variable is passed to commands
+    int owned;          // Non-zero if entry was allocated by the shell, not inherited
+};
+
+// Variables of the shell, and the environment snapshot that environ points at
+// The snapshot is shared by every launch and only rebuilt after an exported variable changed;
+// entries it still points at are retired instead of freed until then
+struct variables {
+    struct variable *slots;     // Open-addressing table, a power of two in size
+    size_t mask;                // Number of slots minus one
+    size_t count;               // Number of occupied slots
+    char **envp;                // Environment snapshot allocated by the shell, NULL while environ is inherited
+    int dirty;                  // An exported variable changed since the snapshot was built
+    char **retired;             // Replaced entries the snapshot may still point at
+    size_t num_retired;
+    size_t cap_retired;
+    size_t rebuilds;            // Number of snapshots built
+} variables = { NULL, 0, 0, NULL, 0, NULL, 0, 0, 0 };
+
+// Last exit status of a command, what $? expands to
+int last_status = 0;
+// Process ID of the shell, what $$ expands to, also in copies of the shell
+pid_t shell_pid = 0;
+// Process ID of the shell's parent, also in copies of the shell
+pid_t shell_ppid = 0;
+
+// Function to hash the first len bytes of a variable name (FNV-1a)
+uint32_t hash_variable_name(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Function to measure the variable name at the start of s, 0 if s doesn't start with one
+size_t variable_name_len(const char *s) {
+    size_t len = 0;
+    if (!isalpha((unsigned char) s[0]) && s[0] != '_') {
+        return 0;
+    }
+    while (isalnum((unsigned char) s[len]) || s[len] == '_') {
+        len++;
+    }
+    return len;
+}
+
+// Function to find the slot of a variable, or the empty slot where it belongs
+struct variable *find_variable_slot(const char *name, size_t len, uint32_t hash) {
+    size_t i = hash & variables.mask;
+    while (variables.slots[i].entry != NULL &&
+           (variables.slots[i].hash != hash || variables.slots[i].name_len != len ||
+            memcmp(variables.slots[i].entry, name, len))) {
+        i = (i + 1) & variables.mask; // Linear probing
+    }
+    return &variables.slots[i];
+}
+
+// Function to find a variable by the first len bytes of name, NULL if it isn't set
+struct variable *find_variable(const char *name, size_t len) {
+    if (variables.slots == NULL) {
+        return NULL;
+    }
+    struct variable *v = find_variable_slot(name, len, hash_variable_name(name, len));
+    return v->entry != NULL ? v : NULL;
+}
+
+// Function to get the value of a variable, NULL if it isn't set
+const char *get_variable(const char *name, size_t len) {
+    struct variable *v = find_variable(name, len);
+    return v != NULL ? v->entry + v->name_len + 1 : NULL;
+}
+
+// Function to let go of a variable's entry once no snapshot can point at it any more
+void retire_entry(struct variable *v) {
+    if (!v->owned) {
+        return; // Inherited entries belong to the original environment
+    }
+    if (!v->exported) {
+        free(v->entry);
+        return;
+    }
+    if (variables.num_retired == variables.cap_retired) {
+        variables.cap_retired = variables.cap_retired ? variables.cap_retired * 2 : 16;
+        variables.retired = realloc(variables.retired, variables.cap_retired * sizeof(char *));
+    }
+    variables.retired[variables.num_retired++] = v->entry;
+}
+
+// Function to store a "NAME=value" entry, taking ownership of it if owned is set
+// exported is 1 to export the variable, 0 to keep whether it was exported
+void store_variable(char *entry, size_t name_len, int exported, int owned) {
+    // Keep the table at most half full, doubling it when needed
+    if (variables.slots == NULL || (variables.count + 1) * 2 > variables.mask + 1) {
+        struct variable *old = variables.slots;
+        size_t old_size = old ? variables.mask + 1 : 0;
+        variables.mask = old ? old_size * 2 - 1 : 63;
+        variables.slots = calloc(variables.mask + 1, sizeof(struct variable));
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].entry != NULL) {
+                *find_variable_slot(old[i].entry, old[i].name_len, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+    uint32_t hash = hash_variable_name(entry, name_len);
+    struct variable *v = find_variable_slot(entry, name_len, hash);
+    if (v->entry == NULL) {
+        v->name_len = name_len;
+        v->hash = hash;
+        v->exported = 0;
+        variables.count++;
+    } else {
+        retire_entry(v);
+    }
+    v->entry = entry;
+    v->owned = owned;
+    v->exported |= exported;
+    variables.dirty |= v->exported;
+}
+
+// Function to set a variable to the first value_len bytes of value
+void set_variable(const char *name, size_t name_len, const char *value, size_t value_len, int exported) {
+    char *entry = malloc(name_len + value_len + 2);
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len);
+    entry[name_len + 1 + value_len] = '\0';
+    store_variable(entry, name_len, exported, 1);
+}
+
+// Function to remove a variable, shifting later entries back so no tombstones are needed
+void unset_variable(const char *name, size_t len) {
+    struct variable *v = find_variable(name, len);
+    if (v == NULL) {
+        return;
+    }
+    size_t mask = variables.mask, hole = v - variables.slots;
+    variables.dirty |= v->exported;
+    retire_entry(v);
+    for (size_t i = (hole + 1) & mask; variables.slots[i].entry != NULL; i = (i + 1) & mask) {
+        size_t home = variables.slots[i].hash & mask;
+        // Move the entry into the hole unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            variables.slots[hole] = variables.slots[i];
+            hole = i;
+        }
+    }
+    variables.slots[hole].entry = NULL;
+    variables.count--;
+}
+
+// Function to take the inherited environment as the shell's exported variables
+// Entries are used where they are; environ stays the snapshot until one of them changes
+void init_variables(void) {
+    for (char **e = environ; *e != NULL; e++) {
+        char *eq = strchr(*e, '=');
+        if (eq != NULL && eq > *e) {
+            store_variable(*e, eq - *e, 1, 0);
+        }
+    }
+    variables.dirty = 0;
+    shell_pid = getpid();
+    shell_ppid = getppid();
+}
+
+// Function to rebuild the environment snapshot if an exported variable changed since the last one
+// environ points at the snapshot, so posix_spawn(), execv() and getenv() all see it
+void sync_environ(void) {
+    size_t n = 0;
+    char **envp;
+
+    if (!variables.dirty) {
+        return;
+    }
+    envp = malloc((variables.count + 1) * sizeof(char *));
+    for (size_t i = 0; variables.slots != NULL && i <= variables.mask; i++) {
+        if (variables.slots[i].entry != NULL && variables.slots[i].exported) {
+            envp[n++] = variables.slots[i].entry;
+        }
+    }
+    envp[n] = NULL;
+    free(variables.envp);
+    environ = variables.envp = envp;
+    // Nothing points at the replaced entries any more
+    for (size_t i = 0; i < variables.num_retired; i++) {
+        free(variables.retired[i]);
+    }
+    variables.num_retired = 0;
+    variables.dirty = 0;
+    variables.rebuilds++;
+}
+
+// Function to build the environment of a command run with assignments in front of it:
+// the snapshot with the n "NAME=value" words at assigns put in, in the command arena
+char **environ_with(char **assigns, size_t n) {
+    size_t count = 0, k = 0;
+    char **envp;
+
+    while (environ[count] != NULL) {
+        count++;
+    }
+    envp = arena_alloc(&command_arena, (count + n + 1) * sizeof(char *));
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strchrnul(environ[i], '=') - environ[i], a;
+        for (a = 0; a < n && (strncmp(assigns[a], environ[i], len) || assigns[a][len] != '='); a++) {
+        }
+        if (a == n) {
+            envp[k++] = environ[i]; // Not overridden
+        }
+    }
+    memcpy(envp + k, assigns, n * sizeof(char *));
+    envp[k + n] = NULL;
+    return envp;
+}
+
+// Function to free the variables and environment snapshot at exit
+void free_variables(void) {
+    static char *empty[] = { NULL };
+    for (size_t i = 0; variables.slots != NULL && i <= variables.mask; i++) {
+        if (variables.slots[i].entry != NULL && variables.slots[i].owned) {
+            free(variables.slots[i].entry);
+        }
+    }
+    for (size_t i = 0; i < variables.num_retired; i++) {
+        free(variables.retired[i]);
+    }
+    if (variables.envp != NULL) {
+        environ = empty; // The snapshot's entries are gone
+    }
+    free(variables.envp);
+    free(variables.slots);
+    free(variables.retired);
+    variables = (struct variables) { NULL, 0, 0, NULL, 0, NULL, 0, 0, 0 };
+}
+
+// Most directory listings kept for glob expansion
+#define DIR_CACHE_SLOTS 64
+// Room getdents64() is given for each batch of entries
+#define DIR_READ_SIZE (1 << 16)
+// A directory changed this close to its scan may change again with the same mtime,
+// as on filesystems with one-second timestamps, so its listing isn't trusted again
+#define DIR_RACY_NS 1000000000ull
+
+// Entries of one directory as getdents64() returned them, with an index in name order
+struct dir_listing {
+    dev_t dev;                  // Device and inode of the directory, dev 0 if the slot is empty
+    ino_t ino;
+    struct timespec mtime;      // Modification time when the directory was read
+    int racy;                   // mtime was too close to the scan for the listing to be reused
+    int pinned;                 // Number of expansions walking the listing, it isn't replaced meanwhile
+    char *dirents;              // Raw linux_dirent64 records, each name NUL-terminated after its d_type
+    uint32_t *sorted;           // Offsets of the entry names in dirents, in strcmp() order
+    size_t count;               // Number of entries, . and .. left out
+    uint64_t used;              // Lookup clock of the last use, the oldest listing is replaced
+};
+
+// Directory listings reused by glob expansion until the directory's mtime changes
+struct dir_cache {
+    struct dir_listing slots[DIR_CACHE_SLOTS];
+    uint64_t clock;             // Number of lookups so far
+    size_t hits;                // Lookups answered without reading the directory
+    size_t scans;               // Directories read
+} dir_cache;
+
+// Words produced by expanding one command's arguments, reused from command to command
+struct glob_words {
+    char **words;
+    size_t len;
+    size_t cap;
+} glob_words = { NULL, 0, 0 };
+
+// Function to order two entry names of the listing being sorted
+int compare_dir_names(const void *a, const void *b, void *dirents) {
+    return strcmp((char *) dirents + *(const uint32_t *) a, (char *) dirents + *(const uint32_t *) b);
+}
+
+// Function to read a directory into a listing with getdents64(), reusing the listing's buffers
+// Returns -1 if the directory can't be read
+int scan_directory(struct dir_listing *l, int fd) {
+    size_t size = 0, cap = 0, index_cap = 0;
+    struct timespec now;
+    ssize_t got;
+
+    l->count = 0;
+    for (; ; ) {
+        if (cap - size < DIR_READ_SIZE) {
+            cap = cap ? cap * 2 : 2 * DIR_READ_SIZE;
+            l->dirents = realloc(l->dirents, cap);
+        }
+        if ((got = syscall(SYS_getdents64, fd, l->dirents + size, cap - size)) <= 0) {
+            break;
+        }
+        // d_type sits right before d_name, so every name is followed by its record's padding
+        for (char *p = l->dirents + size, *end = p + got; p < end; p += ((struct dirent64 *) p)->d_reclen) {
+            const char *name = ((struct dirent64 *) p)->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (l->count == index_cap) {
+                index_cap = index_cap ? index_cap * 2 : 256;
+                l->sorted = realloc(l->sorted, index_cap * sizeof(uint32_t));
+            }
+            l->sorted[l->count++] = name - l->dirents;
+        }
+        size += got;
+    }
+    if (got < 0) {
+        l->dev = 0;
+        return -1;
+    }
+    if (l->count > 0) {
+        qsort_r(l->sorted, l->count, sizeof(uint32_t), compare_dir_names, l->dirents);
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    l->racy = (int64_t) (now.tv_sec - l->mtime.tv_sec) * 1000000000 + now.tv_nsec - l->mtime.tv_nsec < (int64_t) DIR_RACY_NS;
+    dir_cache.scans++;
+    return 0;
+}
+
+// Function to get the listing of a directory, "" meaning the current one
+// The cached listing is used while the directory's mtime is unchanged, otherwise it is read again
+// Returns NULL if the directory can't be read
+struct dir_listing *list_directory(const char *dir) {
+    struct dir_listing *l = NULL, *oldest = &dir_cache.slots[0];
+    struct stat st;
+    int fd;
+
+    if (stat(*dir ? dir : ".", &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    dir_cache.clock++;
+    for (size_t i = 0; i < DIR_CACHE_SLOTS && l == NULL; i++) {
+        struct dir_listing *s = &dir_cache.slots[i];
+        if (s->dev == st.st_dev && s->ino == st.st_ino) {
+            l = s;
+        } else if (!s->pinned && (oldest->pinned || s->used < oldest->used)) {
+            oldest = s;
+        }
+    }
+    // A listing being walked is reused even if stale, through a symbolic link back up the tree
+    if (l != NULL && (l->pinned || (!l->racy && l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+        l->used = dir_cache.clock;
+        dir_cache.hits++;
+        return l;
+    }
+    if (l == NULL && oldest->pinned) {
+        return NULL; // Every listing is being walked by a pattern deeper than the cache
+    } else if (l == NULL) {
+        l = oldest; // Its buffers are reused for the new listing
+    }
+    if ((fd = open(*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    // The mtime is taken before reading, a change made meanwhile shows up as a newer one
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtim;
+    l->used = dir_cache.clock;
+    if (scan_directory(l, fd) < 0) {
+        l = NULL;
+    }
+    close(fd);
+    return l;
+}
+
+// Function to add a word to the expansion of the command being built
+void push_glob_word(char *word) {
+    if (glob_words.len == glob_words.cap) {
+        glob_words.cap = glob_words.cap ? glob_words.cap * 2 : 64;
+        glob_words.words = realloc(glob_words.words, glob_words.cap * sizeof(char *));
+    }
+    glob_words.words[glob_words.len++] = word;
+}
+
+// Function to check whether a word contains wildcards
+int has_wildcards(const char *word) {
+    return strpbrk(word, "*?[") != NULL;
+}
+
+// Function to add every path matching pat, relative to the directory path[0..len), to glob_words
+// Each component of pat is matched against one directory listing, whose sorted order gives
+// sorted matches; components without wildcards before the last one are taken as they are
+void glob_directory(char *path, size_t len, const char *pat) {
+    const char *slash = strchrnul(pat, '/'), *rest = slash;
+    size_t comp_len = slash - pat, prefix_len = strcspn(pat, "*?[\\");
+    struct dir_listing *l;
+    char comp[NAME_MAX + 1];
+
+    while (*rest == '/') {
+        rest++;
+    }
+    if (comp_len > NAME_MAX) {
+        return;
+    }
+    if (prefix_len >= comp_len && *slash == '/') {
+        if (len + comp_len + 1 >= PATH_MAX) {
+            return;
+        }
+        memcpy(path + len, pat, comp_len); // A plain directory name needs no listing
+        path[len + comp_len] = '/';
+        path[len + comp_len + 1] = '\0';
+        if (*rest == '\0') {
+            struct stat st;
+            if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                push_glob_word(arena_strdup(&command_arena, path));
+            }
+        } else {
+            glob_directory(path, len + comp_len + 1, rest);
+        }
+        return;
+    }
+    memcpy(comp, pat, comp_len);
+    comp[comp_len] = '\0';
+    if (prefix_len > comp_len) {
+        prefix_len = comp_len;
+    }
+    path[len] = '\0';
+    if ((l = list_directory(path)) == NULL) {
+        return;
+    }
+
+    l->pinned++;
+    // Names starting with the literal prefix of the component are contiguous in sorted order
+    size_t lo = 0, hi = l->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(l->dirents + l->sorted[mid], comp, prefix_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (size_t i = lo; i < l->count; i++) {
+        const char *name = l->dirents + l->sorted[i];
+        size_t name_len = strlen(name);
+        unsigned char type = name[-1];
+        struct stat st;
+
+        if (strncmp(name, comp, prefix_len) != 0) {
+            break;
+        }
+        // A leading '.' has to be matched by the pattern itself
+        if (fnmatch(comp, name, FNM_PERIOD) != 0 || len + name_len + 1 >= PATH_MAX) {
+            continue;
+        }
+        memcpy(path + len, name, name_len + 1);
+        if (*slash == '\0') {
+            push_glob_word(arena_strdup(&command_arena, path));
+            continue;
+        }
+        // More components follow, so only directories can match
+        if (type != DT_DIR && ((type != DT_LNK && type != DT_UNKNOWN) || stat(path, &st) < 0 || !S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        path[len + name_len] = '/';
+        path[len + name_len + 1] = '\0';
+        if (*rest == '\0') {
+            push_glob_word(arena_strdup(&command_arena, path));
+        } else {
+            glob_directory(path, len + name_len + 1, rest);
+        }
+    }
+    l->pinned--;
+}
+
+// Function to add the paths a pattern matches to glob_words, or the pattern itself if none do
+void glob_word(char *word) {
+    size_t start = glob_words.len, len = 0;
+    const char *pat = word;
+    char path[PATH_MAX];
+
+    // An absolute pattern is matched from the root
+    while (*pat == '/') {
+        path[len++] = '/';
+        pat++;
+    }
+    path[len] = '\0';
+    if (*pat != '\0' && len < PATH_MAX) {
+        glob_directory(path, len, pat);
+    }
+    if (glob_words.len == start) {
+        push_glob_word(word);
+    }
+}
+
+// Bytes of the word being expanded, reused from word to word
+struct expand_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} expand_buffer = { NULL, 0, 0 };
+
+// Function to add n bytes to the word being expanded
+void append_expanded(const char *s, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (expand_buffer.len + n > expand_buffer.cap) {
+        expand_buffer.cap = MAX(expand_buffer.cap * 2, expand_buffer.len + n + 256);
+        expand_buffer.data = realloc(expand_buffer.data, expand_buffer.cap);
+    }
+    memcpy(expand_buffer.data + expand_buffer.len, s, n);
+    expand_buffer.len += n;
+}
+
+// Function to replace the $NAME, ${NAME}, $? and $$ references of a word with their values,
+// unset variables expanding to nothing; a '$' starting no reference is kept
+// Returns word itself if it has no references, otherwise its expansion in the command arena
+char *expand_variables(char *word) {
+    const char *p = word, *dollar = strchr(word, '$');
+    char num[24];
+
+    if (dollar == NULL) {
+        return word;
+    }
+    expand_buffer.len = 0;
+    for (; dollar != NULL; dollar = strchr(p, '$')) {
+        const char *name = dollar + 1, *value = NULL;
+        size_t len = variable_name_len(name), skip = len;
+        size_t braced = name[0] == '{' ? variable_name_len(name + 1) : 0; // Name inside ${...}
+
+        append_expanded(p, dollar - p);
+        if (braced > 0 && name[braced + 1] == '}') {
+            value = get_variable(name + 1, braced);
+            skip = braced + 2;
+        } else if (len > 0) {
+            value = get_variable(name, len);
+        } else if (name[0] == '?' || name[0] == '$') {
+            snprintf(num, sizeof(num), "%d", name[0] == '?' ? last_status : (int) shell_pid);
+            value = num;
+            skip = 1;
+        } else {
+            value = "$";
+        }
+        if (value != NULL) {
+            append_expanded(value, strlen(value));
+        }
+        p = name + skip;
+    }
+    append_expanded(p, strlen(p) + 1); // The rest of the word and its NUL
+    return memcpy(arena_alloc(&command_arena, expand_buffer.len), expand_buffer.data, expand_buffer.len);
+}
+
+// Function to expand the words of a command right before it runs: variable references first,
+// then wildcards; a word expanding to nothing is dropped
+// "NAME=value" words in front of the command, as typed, are moved from argv to assigns
+// and make up the command's environment; has_vars is set if the tokenizer saw a '$'
+void expand_command(struct command *c, int has_vars) {
+    int glob = !options[OPT_NOGLOB].value;
+    size_t n = 0, wild = 0, len;
+
+    while (c->argv[n] != NULL && (len = variable_name_len(c->argv[n])) > 0 && c->argv[n][len] == '=') {
+        if (has_vars) {
+            c->argv[n] = expand_variables(c->argv[n]);
+        }
+        n++;
+    }
+    c->assigns = c->argv;
+    c->num_assigns = n;
+    c->argv += n;
+    for (size_t i = 0; glob && c->argv[i] != NULL; i++) {
+        wild += has_wildcards(c->argv[i]);
+    }
+    for (struct redirect *r = c->redirs; has_vars && r != NULL; r = r->next) {
+        if (r->target != NULL) {
+            r->target = expand_variables(r->target);
+        }
+    }
+    // Most commands have neither references nor wildcards and keep the tokenizer's argv
+    if (has_vars || wild > 0) {
+        glob_words.len = 0;
+        for (size_t i = 0; c->argv[i] != NULL; i++) {
+            char *word = has_vars ? expand_variables(c->argv[i]) : c->argv[i];
+            if (word[0] == '\0') {
+                continue; // Only an expansion can leave an empty word
+            } else if (glob && has_wildcards(word)) {
+                glob_word(word);
+            } else {
+                push_glob_word(word);
+            }
+        }
+        push_glob_word(NULL);
+        c->argv = arena_alloc(&command_arena, glob_words.len * sizeof(char *));
+        memcpy(c->argv, glob_words.words, glob_words.len * sizeof(char *));
+    }
+    c->cmd = c->argv[0];
+    c->envp = n > 0 && c->cmd != NULL ? environ_with(c->assigns, n) : NULL;
+}
+
+// Function to expand every stage of a pipeline right before it runs, after bringing the
+// environment snapshot up to date
+// Returns 1 if the pipeline was only assignments, which have been made, -1 after reporting
+// a stage left without a command, 0 otherwise
+int expand_pipeline(struct pipeline *p) {
+    sync_environ();
+    for (size_t s = 0; s < p->len; s++) {
+        expand_command(&p->stages[s], p->has_vars);
+    }
+    if (p->len == 1 && p->stages[0].cmd == NULL) {
+        const struct command *c = &p->stages[0];
+        // Like a background job, a background assignment can't change the shell
+        for (size_t i = 0; !p->background && i < c->num_assigns; i++) {
+            size_t len = variable_name_len(c->assigns[i]);
+            const char *value = c->assigns[i] + len + 1;
+            set_variable(c->assigns[i], len, value, strlen(value), 0);
+        }
+        return 1;
+    }
+    for (size_t s = 0; s < p->len; s++) {
+        if (p->stages[s].cmd == NULL) {
+            fprintf(stderr, "Stage %zu of the pipeline has no command\n", s + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to free the directory listings and expansion buffers at exit
+void free_dir_cache(void) {
+    for (size_t i = 0; i < DIR_CACHE_SLOTS; i++) {
+        free(dir_cache.slots[i].dirents);
+        free(dir_cache.slots[i].sorted);
+    }
+    memset(&dir_cache, 0, sizeof(dir_cache));
+    free(glob_words.words);
+    glob_words = (struct glob_words) { NULL, 0, 0 };
+    free(expand_buffer.data);
+    expand_buffer = (struct expand_buffer) { NULL, 0, 0 };
+}
+
+// Longest command line kept in the history
+#define HISTORY_MAX_LINE (1 << 16)
+
+// Command history: one line per entry in a file every shell appends to without locking
+// Entries are read through a mapping of the file, indexed the first time they are needed
+struct history {
+    int fd;                 // History file, opened for appending; -1 without history
+    const char *data;       // Mapping of the file, NULL until the first lookup
+    size_t mapped;          // Bytes mapped
+    size_t *starts;         // Offset of every indexed entry, oldest first
+    size_t len;             // Number of indexed entries
+    size_t cap;             // Capacity of starts
+    size_t indexed;         // End of the last indexed entry, where indexing resumes
+    int write_failed;       // Set once a failed append was reported, a full disk would repeat it every line
+} history = { -1, NULL, 0, NULL, 0, 0, 0, 0 };
+
+// Function to open the history file named by HISTFILE, by default ~/.308sh_history
+void init_history(void) {
+    const char *file = getenv("HISTFILE"), *home = getenv("HOME");
+    char path[PATH_MAX];
+
+    if (file == NULL) {
+        if (home == NULL || snprintf(path, sizeof(path), "%s/.308sh_history", home) >= (int) sizeof(path)) {
+            return;
+        }
+        file = path;
+    }
+    // O_APPEND makes each entry's single write land whole at the end, whatever other shells do
+    history.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+// Function to append a command line to the history file, with one write() so that concurrent
+// shells never interleave inside an entry
+void add_history(const char *line, size_t len) {
+    struct iovec iov[2] = { { (void *) line, len }, { "\n", 1 } };
+    size_t i = 0;
+
+    while (len > 0 && line[len - 1] == '\n') {
+        len--;
+    }
+    while (i < len && isspace((unsigned char) line[i])) {
+        i++;
+    }
+    if (history.fd < 0 || i == len || len > HISTORY_MAX_LINE || memchr(line, '\0', len) != NULL) {
+        return; // Blank lines aren't worth keeping, and an entry must stay a single line
+    }
+    iov[0].iov_len = len;
+    ssize_t n = writev(history.fd, iov, 2);
+    if (n != (ssize_t) len + 1 && !history.write_failed) {
+        fprintf(stderr, "history: can't append to the history file: %s\n", strerror(n < 0 ? errno : ENOSPC));
+        history.write_failed = 1;
+    }
+}
+
+// Function to bring the mapping and index up to date with entries appended since the last lookup,
+// by this shell or any other; only the new part of the file is scanned
+// Returns -1 if there is no history file
+int sync_history(void) {
+    struct stat st;
+    const char *end, *p, *nl;
+
+    if (history.fd < 0 || fstat(history.fd, &st) < 0) {
+        return -1;
+    }
+    // The file was cut short behind our back, reading past its end would raise SIGBUS
+    if ((size_t) st.st_size < history.mapped) {
+        munmap((void *) history.data, history.mapped);
+        history.data = NULL;
+        history.mapped = history.len = history.indexed = 0;
+    }
+    if ((size_t) st.st_size > history.mapped) {
+        void *data = history.data == NULL
+            ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0)
+            : mremap((void *) history.data, history.mapped, st.st_size, MREMAP_MAYMOVE);
+        if (data == MAP_FAILED) {
+            return history.data != NULL ? 0 : -1; // Keep what is mapped already
+        }
+        history.data = data;
+        history.mapped = st.st_size;
+    }
+    // Index complete lines only, an entry being written still lacks its newline
+    p = history.data + history.indexed;
+    end = history.data + history.mapped;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        if (history.len == history.cap) {
+            history.cap = history.cap ? history.cap * 2 : 1024;
+            history.starts = realloc(history.starts, history.cap * sizeof(size_t));
+        }
+        history.starts[history.len++] = p - history.data;
+        p = nl + 1;
+    }
+    history.indexed = p - history.data;
+    return 0;
+}
+
+// Function to get the text of entry i, oldest first, and its length without the newline
+const char *history_entry(size_t i, int *len) {
+    size_t end = i + 1 < history.len ? history.starts[i + 1] : history.indexed;
+    *len = (int) (end - 1 - history.starts[i]);
+    return history.data + history.starts[i];
+}
+
+// Function to release the history mapping and index
+void free_history(void) {
+    if (history.data != NULL) {
+        munmap((void *) history.data, history.mapped);
+    }
+    if (history.fd >= 0) {
+        close(history.fd);
+    }
+    free(history.starts);
+    history = (struct history) { -1, NULL, 0, NULL, 0, 0, 0 };
+}
+
+// Size of the buffer job events wait in until they are written
+#define EVENT_BUFFER_SIZE (1 << 16)
+// Longest single event record
+#define EVENT_MAX_RECORD 1024
+
+// Stream of job lifecycle events, one JSON object per line, written to a descriptor or
+// Unix socket given with -e; records are batched and written without ever blocking the shell
+struct event_stream {
+    int fd;                     // Where records go, -1 if events are off
+    int is_socket;              // Set when fd is a socket, written with send()
+    const char *path;           // Unix socket fd is connected to, NULL for a descriptor given by number
+    char buf[EVENT_BUFFER_SIZE];// Records not written yet
+    size_t len;                 // Bytes in buf
+    int64_t clock_offset;       // CLOCK_REALTIME minus CLOCK_MONOTONIC, to stamp records with wall time
+    size_t lost;                // Records dropped because the reader fell behind, reported once there is room
+} events = { .fd = -1 };
+
+// Function to open the event stream: a number names an open descriptor, anything else the
+// path of a Unix stream socket to connect to
+// Returns -1 after reporting a destination that can't be used
+int init_events(const char *dest) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct timespec real, mono;
+    struct stat st;
+
+    events.path = NULL;
+    char *end;
+    long fd = strtol(dest, &end, 10);
+
+    if (*dest != '\0' && *end == '\0') {
+        if (fd < 0 || fd > INT_MAX || fcntl(fd, F_GETFD) < 0) {
+            fprintf(stderr, "-e: %s: not an open descriptor\n", dest);
+            return -1;
+        }
+        events.fd = fd;
+        fcntl(events.fd, F_SETFD, FD_CLOEXEC); // Commands don't get to write to it
+    } else {
+        if (strlen(dest) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "-e: %s: socket path too long\n", dest);
+            return -1;
+        }
+        strcpy(addr.sun_path, dest);
+        if ((events.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+            connect(events.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror(dest);
+            if (events.fd >= 0) {
+                close(events.fd);
+            }
+            events.fd = -1;
+            return -1;
+        }
+        events.path = dest;
+    }
+    events.is_socket = fstat(events.fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    events.clock_offset = ((int64_t) real.tv_sec - mono.tv_sec) * 1000000000 + real.tv_nsec - mono.tv_nsec;
+    return 0;
+}
+
+// Function to write to the event stream without being killed by SIGPIPE when the reader is gone
+// The shell leaves SIGPIPE alone, so that commands it launches get the default action
+ssize_t write_events(const char *p, size_t n) {
+    sigset_t pipe_set, old, pending;
+    struct timespec zero = { 0, 0 };
+    ssize_t put;
+    int err, raised;
+
+    if (events.is_socket) {
+        return send(events.fd, p, n, MSG_NOSIGNAL);
+    }
+    // Hold SIGPIPE off while writing and take back the one the write raised
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old);
+    sigpending(&pending);
+    raised = !sigismember(&pending, SIGPIPE);
+    put = write(events.fd, p, n);
+    err = errno;
+    if (put < 0 && err == EPIPE && raised) {
+        sigtimedwait(&pipe_set, NULL, &zero);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    errno = err;
+    return put;
+}
+
+// Function to write n bytes of whole records to the event stream
+// A write cut short is finished right away, so the rest of the record follows its start;
+// a descriptor someone else made non-blocking gets up to a second to take it
+// Returns -1 if the stream broke
+int write_records(const char *p, size_t n) {
+    struct pollfd pfd = { .fd = events.fd, .events = POLLOUT };
+    ssize_t put;
+
+    for (size_t off = 0; off < n; off += put) {
+        if ((put = write_events(p + off, n - off)) >= 0) {
+            continue;
+        }
+        put = 0;
+        if (errno == EAGAIN && poll(&pfd, 1, 1000) <= 0) {
+            return -1;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to write out as many buffered records as the reader takes without blocking
+// The descriptor may be shared with other processes, so its flags are left alone: every write
+// is at most PIPE_BUF bytes and only made once poll() reports room for that much
+// Each write ends on a record boundary, so that records of copies of the shell writing to the
+// same pipe never interleave
+// A reader that went away turns the stream off
+void flush_events(void) {
+    struct pollfd pfd = { .fd = events.fd, .events = POLLOUT };
+    size_t done = 0;
+
+    while (done < events.len) {
+        size_t n = events.len - done;
+        if (poll(&pfd, 1, 0) <= 0) {
+            break; // The reader is behind, the records wait in the buffer
+        }
+        if (n > PIPE_BUF) {
+            n = (const char *) memrchr(events.buf + done, '\n', PIPE_BUF) + 1 - (events.buf + done);
+        }
+        if (write_records(events.buf + done, n) < 0) {
+            close(events.fd); // EPIPE or a broken descriptor, nobody is listening any more
+            events.fd = -1;
+            done = events.len;
+            break;
+        }
+        done += n;
+    }
+    memmove(events.buf, events.buf + done, events.len - done);
+    events.len -= done;
+}
+
+// Function to give a copy of the shell a stream of its own: what the shell buffered is left to
+// the shell, and a socket named by path is connected to again, so that the two never share one
+// A descriptor given by number stays shared, whole records of at most PIPE_BUF bytes keep it apart
+void detach_events(void) {
+    events.len = events.lost = 0;
+    if (events.path != NULL) {
+        close(events.fd);
+        events.fd = -1;
+        init_events(events.path);
+    }
+}
+
+// Function to start a record: its opening brace, the event name and the wall time of when,
+// a CLOCK_MONOTONIC time in nanoseconds
+// Returns where the record's fields go, or NULL if there is no room and the record is dropped
+char *begin_event(const char *event, uint64_t when) {
+    if (events.len + 2 * EVENT_MAX_RECORD > EVENT_BUFFER_SIZE) {
+        flush_events();
+    }
+    if (events.fd < 0 || events.len + 2 * EVENT_MAX_RECORD > EVENT_BUFFER_SIZE) {
+        events.lost += events.fd >= 0;
+        return NULL;
+    }
+    // Records lost while the reader was behind are counted before the next one
+    if (events.lost > 0) {
+        events.len += sprintf(events.buf + events.len, "{\"event\":\"lost\",\"count\":%zu}\n", events.lost);
+        events.lost = 0;
+    }
+    return events.buf + events.len + sprintf(events.buf + events.len, "{\"event\":\"%s\",\"time\":%" PRId64,
+                                             event, (int64_t) when + events.clock_offset);
+}
+
+// Function to end the record started at the end of the buffer, whose fields run up to end
+void end_event(char *end) {
+    *end++ = '}';
+    *end++ = '\n';
+    events.len = end - events.buf;
+}
+
+// Function to add a "name":"s" field to a record at p, escaping s for JSON
+// Long strings are cut so that the record stays within EVENT_MAX_RECORD
+char *put_event_string(char *p, const char *name, const char *s) {
+    char *limit = p + EVENT_MAX_RECORD / 2;
+
+    p += sprintf(p, ",\"%s\":\"", name);
+    for (; *s != '\0' && p < limit; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            *p++ = '\\';
+            *p++ = ch;
+        } else if (ch < 0x20 || ch == 0x7f) {
+            p += sprintf(p, "\\u%04x", ch);
+        } else {
+            *p++ = ch;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+// Function to record that a process of a job was started
+void emit_spawn_event(pid_t pid, const struct job *j, const char *cmd) {
+    char *p;
+
+    if (events.fd < 0 || (p = begin_event("spawn", now_ns())) == NULL) {
+        return;
+    }
+    p += sprintf(p, ",\"pid\":%d,\"job\":%d,\"pgid\":%d", pid, j->nprocs > 0 ? j->pids[0] : pid, j->pgid);
+    end_event(put_event_string(p, "cmd", cmd));
+}
+
+// Function to push out the records still buffered when the shell ends, waiting up to a second
+// for a slow reader
+void finish_events(void) {
+    uint64_t deadline = now_ns() + 1000000000ull;
+    struct pollfd pfd = { .fd = events.fd, .events = POLLOUT };
+
+    while (events.fd >= 0 && events.len > 0 && now_ns() < deadline) {
+        flush_events();
+        if (events.len > 0 && poll(&pfd, 1, (int) ((deadline - now_ns()) / 1000000) + 1) < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    if (events.fd >= 0) {
+        close(events.fd);
+        events.fd = -1;
+    }
+}
+
+// Pipe buffer size requested when the bigpipe option is on
+#define BIG_PIPE_SIZE (1 << 20)
+
+// Function to enlarge a pipe's buffer if the bigpipe option asks for it
+void tune_pipe(int fd) {
+    if (options[OPT_BIGPIPE].value) {
+        fcntl(fd, F_SETPIPE_SZ, BIG_PIPE_SIZE); // Best effort, capped by fs.pipe-max-size
+    }
+}
+
+// Function to close the shell's descriptors for a command's redirection targets
+void close_redirects(const struct command *c) {
+    for (struct redirect *r = c->redirs; r != NULL; r = r->next) {
+        if (r->open_fd >= 0) {
+            close(r->open_fd);
+            r->open_fd = -1;
+        }
+    }
+}
+
+// Function to open the files a command's redirections refer to
+// The descriptors are close-on-exec, children get them through dup2()
+// Returns -1 after reporting the first target that couldn't be opened
+int open_redirects(const struct command *c) {
+    struct stat st;
+    for (struct redirect *r = c->redirs; r != NULL; r = r->next) {
+        if (r->target == NULL) {
+            continue; // N>&M, nothing to open
+        }
+        int flags = r->flags | O_CLOEXEC;
+        // O_DIRECT bypasses the page cache, the command must then do aligned I/O
+        if (options[OPT_ODIRECT].value) {
+            r->open_fd = open(r->target, flags | O_DIRECT, 0666);
+            if (r->open_fd < 0 && errno == EINVAL) {
+                r->open_fd = open(r->target, flags, 0666); // The file system doesn't support it
+            }
+        } else {
+            r->open_fd = open(r->target, flags, 0666);
+        }
+        if (r->open_fd < 0) {
+            perror(r->target);
+            close_redirects(c);
+            return -1;
+        }
+        if (fstat(r->open_fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+            tune_pipe(r->open_fd); // Named pipes get the large buffer too
+        }
+    }
+    return 0;
+}
+
+// Function to make a command's redirections take effect in the current process
+int apply_redirects(const struct command *c) {
+    for (const struct redirect *r = c->redirs; r != NULL; r = r->next) {
+        if (dup2(r->target != NULL ? r->open_fd : r->dup_fd, r->fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to place a process according to a job's placement, called in the child before exec
+int apply_placement(const struct placement *pl) {
+    // Join the job's cgroup first so everything the command allocates is charged to it
+    if (pl->procs_fd >= 0 && write(pl->procs_fd, "0", 1) < 0) {
+        return -1;
+    }
+    if (pl->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &pl->cpus) < 0) {
+        return -1;
+    }
+    if (pl->node >= 0) {
+        unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = { 0 };
+        mask[pl->node / (8 * sizeof(unsigned long))] |= 1UL << (pl->node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, pl->mem_mode, mask, (unsigned long) CPU_SETSIZE) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Position of the next background job in the spread rotation
+size_t spread_next = 0;
+
+// Function to pick the placement of the next background job in spread mode
+// Jobs take turns over the CPUs the shell may use, preferring memory on the CPU's node
+// Returns -1 if the shell's CPUs can't be determined
+int next_spread_placement(struct placement *pl) {
+    cpu_set_t allowed;
+    int count, cpu, nth;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || (count = CPU_COUNT(&allowed)) == 0) {
+        return -1;
+    }
+    nth = spread_next++ % count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+            break;
+        }
+    }
+    CPU_ZERO(&pl->cpus);
+    CPU_SET(cpu, &pl->cpus);
+    pl->has_cpus = 1;
+    load_numa_topology();
+    pl->node = numa.nodes > 1 ? cpu_node(cpu) : -1; // One node has nothing to prefer
+    pl->mem_mode = MPOL_PREFERRED;
+    pl->limits = NULL;
+    pl->procs_fd = -1;
+    return 0;
+}
+
+// Where job cgroups are created: the shell's cgroup in the cgroup v2 hierarchy
+struct job_cgroups {
+    char *base;             // Path of the shell's cgroup, NULL until the first limited job
+    int moved;              // Set once the shell moved into a leaf of its own below base
+    unsigned long next;     // Sequence number of the next job cgroup
+    size_t live;            // Job cgroups created and not released yet
+    char enabled[64];       // "-cpu -io " for the controllers the shell enabled, undone at exit
+    char **lingering;       // Released job cgroups that processes outlived, removed once empty
+    size_t num_lingering;
+    size_t cap_lingering;
+} job_cgroups = { NULL, 0, 0, 0, "", NULL, 0, 0 };
+
+// Function to write a line to a cgroup interface file
+// Returns -1 with errno set if the kernel rejected it
+int write_cgroup_file(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd, err;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int) sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    n = write(fd, value, strlen(value));
+    err = errno;
+    close(fd);
+    errno = err;
+    return n < 0 ? -1 : 0;
+}
+
+// Function to find the shell's cgroup from the cgroup2 mount and /proc/self/cgroup
+// Returns -1 if the shell doesn't run under a cgroup v2 hierarchy
+int find_cgroup_base(void) {
+    char *line = NULL, *mount = NULL, *own = NULL;
+    size_t cap = 0;
+    FILE *f;
+
+    // mountinfo lines are "id parent dev root mountpoint options... - fstype source options"
+    if ((f = fopen("/proc/self/mountinfo", "r")) != NULL) {
+        while (mount == NULL && getline(&line, &cap, f) > 0) {
+            char point[PATH_MAX];
+            const char *sep = strstr(line, " - ");
+            if (sep != NULL && !strncmp(sep, " - cgroup2 ", 11) &&
+                sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1) {
+                mount = strdup(point);
+            }
+        }
+        fclose(f);
+    }
+    // The v2 hierarchy is the "0::" line
+    if ((f = fopen("/proc/self/cgroup", "r")) != NULL) {
+        while (own == NULL && getline(&line, &cap, f) > 0) {
+            if (!strncmp(line, "0::", 3)) {
+                line[strcspn(line, "\n")] = '\0';
+                own = strdup(&line[3]);
+            }
+        }
+        fclose(f);
+    }
+    if (mount != NULL && own != NULL) {
+        job_cgroups.base = malloc(strlen(mount) + strlen(own) + 1);
+        sprintf(job_cgroups.base, "%s%s", mount, strcmp(own, "/") ? own : "");
+    }
+    free(line);
+    free(mount);
+    free(own);
+    return job_cgroups.base != NULL ? 0 : -1;
+}
+
+// Function to make a controller available to the job cgroups below the shell's cgroup
+// A cgroup with processes can't pass controllers on, so the shell moves into a leaf first if needed
+int enable_cgroup_controller(const char *controller) {
+    char line[32], off[32];
+    int ret;
+
+    snprintf(line, sizeof(line), "+%s", controller);
+    ret = write_cgroup_file(job_cgroups.base, "cgroup.subtree_control", line);
+    if (ret < 0 && errno == EBUSY && !job_cgroups.moved) {
+        char leaf[PATH_MAX];
+        snprintf(leaf, sizeof(leaf), "%s/shell-%d", job_cgroups.base, getpid());
+        if ((mkdir(leaf, 0755) == 0 || errno == EEXIST) && write_cgroup_file(leaf, "cgroup.procs", "0") == 0) {
+            job_cgroups.moved = 1;
+            ret = write_cgroup_file(job_cgroups.base, "cgroup.subtree_control", line);
+        } else {
+            errno = EBUSY; // The shell stays where it was
+        }
+    }
+    // Remember it so the shell can hand its cgroup back the way it found it
+    snprintf(off, sizeof(off), "-%s ", controller);
+    if (ret == 0 && strstr(job_cgroups.enabled, off) == NULL &&
+        strlen(job_cgroups.enabled) + strlen(off) < sizeof(job_cgroups.enabled)) {
+        strcat(job_cgroups.enabled, off);
+    }
+    return ret;
+}
+
+// Function to create a cgroup for a job and write its limits
+// The cgroup's path is allocated in the command arena, *procs_fd receives its open cgroup.procs
+// Returns NULL after reporting why the cgroup couldn't be set up
+char *create_job_cgroup(const struct cgroup_limit *limits, int *procs_fd) {
+    char *path, file[PATH_MAX];
+
+    if (job_cgroups.base == NULL && find_cgroup_base() < 0) {
+        fprintf(stderr, "cgroup: the shell isn't in a cgroup v2 hierarchy\n");
+        return NULL;
+    }
+    // The controller is the part of the interface file's name before the dot
+    for (const struct cgroup_limit *l = limits; l != NULL; l = l->next) {
+        char controller[16];
+        snprintf(controller, sizeof(controller), "%.*s", (int) strcspn(l->file, "."), l->file);
+        if (enable_cgroup_controller(controller) < 0) {
+            fprintf(stderr, "cgroup: can't enable the %s controller in %s: %s\n",
+                    controller, job_cgroups.base, strerror(errno));
+            return NULL;
+        }
+    }
+    snprintf(file, sizeof(file), "%s/job-%d-%lu", job_cgroups.base, getpid(), job_cgroups.next++);
+    if (mkdir(file, 0755) < 0) {
+        perror(file);
+        return NULL;
+    }
+    path = arena_strdup(&command_arena, file);
+    job_cgroups.live++;
+    for (const struct cgroup_limit *l = limits; l != NULL; l = l->next) {
+        if (write_cgroup_file(path, l->file, l->value) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", l->file, l->value, strerror(errno));
+            rmdir(path);
+            job_cgroups.live--;
+            return NULL;
+        }
+    }
+    snprintf(file, sizeof(file), "%s/cgroup.procs", path);
+    if ((*procs_fd = open(file, O_WRONLY | O_CLOEXEC)) < 0) {
+        perror(file);
+        rmdir(path);
+        job_cgroups.live--;
+        return NULL;
+    }
+    return path;
+}
+
+// Function to tell whether processes are left in a cgroup, from the populated line of its cgroup.events
+// Returns 1 if there are, 0 if it is empty or -1 if the file couldn't be read
+int cgroup_populated(const char *dir) {
+    char path[PATH_MAX], key[32];
+    int value, populated = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/cgroup.events", dir);
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fscanf(f, "%31s %d", key, &value) == 2) {
+            if (!strcmp(key, "populated")) {
+                populated = value;
+            }
+        }
+        fclose(f);
+    }
+    return populated;
+}
+
+// Function to remove a released job cgroup
+// Processes the job left behind keep it populated, it lingers until they are gone too
+void remove_job_cgroup(const char *dir) {
+    job_cgroups.live--;
+    if (cgroup_populated(dir) != 1) {
+        if (rmdir(dir) == 0 || errno == ENOENT) {
+            return;
+        } else if (errno != EBUSY) {
+            perror(dir);
+            return;
+        }
+    }
+    if (job_cgroups.num_lingering == job_cgroups.cap_lingering) {
+        job_cgroups.cap_lingering = job_cgroups.cap_lingering ? job_cgroups.cap_lingering * 2 : 8;
+        job_cgroups.lingering = realloc(job_cgroups.lingering, job_cgroups.cap_lingering * sizeof(char *));
+    }
+    job_cgroups.lingering[job_cgroups.num_lingering++] = strdup(dir);
+}
+
+// Function to remove the lingering job cgroups whose last process has gone
+void retry_job_cgroups(void) {
+    size_t kept = 0;
+    for (size_t i = 0; i < job_cgroups.num_lingering; i++) {
+        char *dir = job_cgroups.lingering[i];
+        if (cgroup_populated(dir) != 1 && (rmdir(dir) == 0 || errno == ENOENT)) {
+            free(dir);
+        } else {
+            job_cgroups.lingering[kept++] = dir;
+        }
+    }
+    job_cgroups.num_lingering = kept;
+}
+
+// Function to clean up the shell's cgroups before it exits
+// What still runs in a lingering job cgroup is killed, and once no job cgroup is left the shell
+// and anything else in its leaf move back to the cgroup it started in, so the leaf can go as well
+void remove_job_cgroups(void) {
+    uint64_t deadline = now_ns() + 1000000000ull;
+    char leaf[PATH_MAX], path[PATH_MAX];
+    FILE *f;
+
+    for (size_t i = 0; i < job_cgroups.num_lingering; i++) {
+        write_cgroup_file(job_cgroups.lingering[i], "cgroup.kill", "1");
+    }
+    // cgroup.kill doesn't wait for the processes to die
+    while (job_cgroups.num_lingering > 0 && now_ns() < deadline) {
+        struct timespec tick = { 0, 10000000 };
+        retry_job_cgroups();
+        if (job_cgroups.num_lingering > 0) {
+            nanosleep(&tick, NULL);
+        }
+    }
+    for (size_t i = 0; i < job_cgroups.num_lingering; i++) {
+        fprintf(stderr, "%s: still has processes, left in place\n", job_cgroups.lingering[i]);
+        free(job_cgroups.lingering[i]);
+    }
+    free(job_cgroups.lingering);
+    job_cgroups.lingering = NULL;
+    job_cgroups.num_lingering = job_cgroups.cap_lingering = 0;
+
+    if (!job_cgroups.moved || job_cgroups.live > 0) {
+        return; // A running job keeps its limits, and with them the leaf
+    }
+    // A cgroup passing controllers on can't hold processes, so they are turned off first
+    if (job_cgroups.enabled[0] != '\0' &&
+        write_cgroup_file(job_cgroups.base, "cgroup.subtree_control", job_cgroups.enabled) < 0) {
+        return;
+    }
+    snprintf(leaf, sizeof(leaf), "%s/shell-%d", job_cgroups.base, getpid());
+    snprintf(path, sizeof(path), "%s/shell-%d/cgroup.procs", job_cgroups.base, getpid());
+    if ((f = fopen(path, "r")) != NULL) {
+        char pid[32];
+        while (fscanf(f, "%31s", pid) == 1) {
+            write_cgroup_file(job_cgroups.base, "cgroup.procs", pid);
+        }
+        fclose(f);
+    }
+    if (rmdir(leaf) < 0) {
+        perror(leaf);
+    }
+    job_cgroups.moved = 0;
+}
+
+// Function to read the usage of a job's cgroup once its last process was reaped, and remove the cgroup
+void release_job_cgroup(struct job *j) {
+    struct job_usage *u = &j->usage;
+    char path[PATH_MAX], key[64];
+    unsigned long long value;
+    FILE *f;
+
+    u->cgroup = 1;
+    u->cg_peak = -1;
+    snprintf(path, sizeof(path), "%s/cpu.stat", j->cgroup);
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fscanf(f, "%63s %llu", key, &value) == 2) {
+            if (!strcmp(key, "usage_usec")) {
+                u->cg_usage_usec = value;
+            }
+        }
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "%s/memory.peak", j->cgroup);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%llu", &value) == 1) {
+            u->cg_peak = value / 1024;
+        }
+        fclose(f);
+    }
+    // io.stat has a line per device: "8:0 rbytes=N wbytes=N rios=N ..."
+    snprintf(path, sizeof(path), "%s/io.stat", j->cgroup);
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fscanf(f, "%63s", key) == 1) {
+            if (sscanf(key, "rbytes=%llu", &value) == 1) {
+                u->cg_rbytes += value;
+            } else if (sscanf(key, "wbytes=%llu", &value) == 1) {
+                u->cg_wbytes += value;
+            }
+        }
+        fclose(f);
+    }
+    remove_job_cgroup(j->cgroup);
+    j->cgroup = NULL;
+}
+
+// epoll set of a pidfd per child, the shell waits on it for exits; -1 if the kernel has no
+// pidfds and the SIGCHLD handler reaps children into the ring instead
+int child_epoll = -1;
+// Number of pidfds open, kept within pidfd_budget so launching never runs out of descriptors
+size_t child_pidfds = 0;
+size_t pidfd_budget = 0;
+// Set by the SIGCHLD handler in pidfd mode: a child stopped or resumed, which pidfds don't report
+volatile sig_atomic_t child_signalled = 0;
+
+// Children no pidfd could be opened for, reaped by PID after a SIGCHLD instead
+struct untracked_children {
+    pid_t *pids;
+    size_t len;
+    size_t cap;
+} untracked = { NULL, 0, 0 };
+
+// Function to watch a new child through a pidfd, its exit then wakes up the event loop
+// The PID can't be reused before the shell reaps the child, so the pidfd is always the right process
+void track_child(pid_t pid) {
+#ifdef SYS_pidfd_open
+    struct epoll_event ev;
+    int fd;
+
+    if (child_epoll < 0) {
+        return; // The SIGCHLD handler reaps every child
+    }
+    fd = syscall(SYS_pidfd_open, pid, 0);
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t) (uint32_t) fd << 32 | (uint32_t) pid; // Which pidfd, and whose
+    if (fd >= 0 && epoll_ctl(child_epoll, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        child_pidfds++;
+        return;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    // Out of descriptors after all, look for this one after every SIGCHLD
+    if (untracked.len == untracked.cap) {
+        untracked.cap = untracked.cap ? untracked.cap * 2 : 16;
+        untracked.pids = realloc(untracked.pids, untracked.cap * sizeof(pid_t));
+    }
+    untracked.pids[untracked.len++] = pid;
+#else
+    (void) pid;
+#endif
+}
+
+// Function to count the arguments of a command, the command name included
+size_t count_args(const struct command *c) {
+    size_t n = 0;
+    while (c->argv[n] != NULL) {
+        n++;
+    }
+    return n;
+}
+
+// Function to fill in the arguments execvp() falls back to when file is a script without #!:
+// /bin/sh file args...; sh_argv needs room for the command's arguments and two more
+void script_argv(const char *file, const struct command *c, char **sh_argv) {
+    size_t n = count_args(c);
+    sh_argv[0] = "sh";
+    sh_argv[1] = (char *) file;
+    memcpy(sh_argv + 2, c->argv + 1, n * sizeof(char *)); // Arguments and the NULL after them
+}
+
+// Function to end a child of fork_command() that can't run its command, passing errno to the parent
+// If even the write fails, the parent sees the pipe close, takes the command for launched and reaps a 127
+void exit_exec_failed(int fd, int err) {
+    while (write(fd, &err, sizeof(err)) < 0 && errno == EINTR) { }
+    _exit(127);
+}
+
+// Function to launch a command with fork+execve
+// Like posix_spawn() it only returns once the child runs the command or failed to,
+// so the child has joined its process group by then
+pid_t fork_command(const char *file, const struct command *c, int in_fd, int out_fd,
+                   const struct placement *pl, pid_t pgid, int tty, int *exec_errno) {
+    int fds[2], err;
+    ssize_t n;
+    pid_t pid;
+
+    // The child reports a failed exec over this pipe, a successful one closes it
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        *exec_errno = 0;
+        return -1;
+    }
+    fflush(stdout); // The child must not inherit and later flush buffered output
+    uint64_t start = now_ns(), forked;
+    if ((pid = fork()) < 0) {
+        err = errno;
+        *exec_errno = 0;
+        close(fds[0]);
+        close(fds[1]);
+        errno = err; // Report why fork() failed, not close()
+        return -1;
+    } else if (pid == 0) {  // Child process
+        close(fds[0]);
+        // Join the job's process group, the terminal can still be taken while SIGTTOU is ignored
+        if (pgid >= 0 && setpgid(0, pgid) < 0) {
+            exit_exec_failed(fds[1], errno);
+        }
+        if (tty >= 0) {
+            tcsetpgrp(tty, getpgrp());
+        }
+        if (shell_terminal >= 0) {
+            default_job_signals();
+        }
+        if (pgid >= 0) {
+            sigprocmask(SIG_SETMASK, &shell_sigmask, NULL); // SIGCHLD is held while a group is launched
+        }
+        // Connect the pipeline's pipes, then the redirections; the originals are closed on exec
+        if ((in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0) || (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0) ||
+            apply_redirects(c) < 0 || (pl != NULL && apply_placement(pl) < 0)) {
+            exit_exec_failed(fds[1], errno);
+        }
+        char **envp = c->envp != NULL ? c->envp : environ;
+        execve(file, c->argv, envp);
+        if (errno == ENOEXEC) {  // No #! line, run it as a shell script like execvp() does
+            char *sh_argv[count_args(c) + 2];
+            script_argv(file, c, sh_argv);
+            execve("/bin/sh", sh_argv, envp);
+            errno = ENOEXEC;  // Report the script, not /bin/sh
+        }
+        exit_exec_failed(fds[1], errno);
+    }
+    forked = now_ns();
+    phases.spawn_ns += forked - start;
+    close(fds[1]);
+    while ((n = read(fds[0], &err, sizeof(err))) < 0 && errno == EINTR) { }
+    close(fds[0]);
+    phases.exec_ns += now_ns() - forked; // The pipe closes when exec succeeds
+    if (n == sizeof(err)) {
+        *exec_errno = err;
+        waitpid(pid, NULL, 0); // The child exits right away, unless the SIGCHLD handler got it first
+        return -1;
+    }
+    return pid;
+}
+
+// Function to launch a command with posix_spawn
+pid_t posix_spawn_command(const char *file, const struct command *c, int in_fd, int out_fd,
+                          pid_t pgid, int tty, int *exec_errno) {
+    posix_spawn_file_actions_t actions, *fa = NULL;
+    posix_spawnattr_t attrs, *attr = NULL;
+    pid_t pid;
+    int err;
+
+    // Put the child in the job's process group and undo the shell's ignored job control signals
+    if (pgid >= 0 || shell_terminal >= 0) {
+        short flags = 0;
+        attr = &attrs;
+        posix_spawnattr_init(attr);
+        if (pgid >= 0) {
+            posix_spawnattr_setpgroup(attr, pgid);
+            posix_spawnattr_setsigmask(attr, &shell_sigmask); // SIGCHLD is held while a group is launched
+            flags |= POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK;
+        }
+        if (shell_terminal >= 0) {
+            sigset_t defaults;
+            sigemptyset(&defaults);
+            for (size_t i = 0; i < NUM_JOB_CONTROL_SIGNALS; i++) {
+                sigaddset(&defaults, job_control_signals[i]);
+            }
+            posix_spawnattr_setsigdefault(attr, &defaults);
+            flags |= POSIX_SPAWN_SETSIGDEF;
+        }
+        posix_spawnattr_setflags(attr, flags);
+    }
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 35)
+    tty = -1; // No way to take the terminal in the child, the parent hands it over after the launch
+#endif
+    // Connect the pipeline's pipes, then the redirections; the originals are closed on exec
+    if (in_fd >= 0 || out_fd >= 0 || c->redirs != NULL || tty >= 0) {
+        fa = &actions;
+        posix_spawn_file_actions_init(fa);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+        // Take the terminal before exec so the command can't read it from the background
+        if (tty >= 0) {
+            posix_spawn_file_actions_addtcsetpgrp_np(fa, tty);
+        }
+#endif
+        if (in_fd >= 0) {
+            posix_spawn_file_actions_adddup2(fa, in_fd, STDIN_FILENO);
+        }
+        if (out_fd >= 0) {
+            posix_spawn_file_actions_adddup2(fa, out_fd, STDOUT_FILENO);
+        }
+        for (const struct redirect *r = c->redirs; r != NULL; r = r->next) {
+            posix_spawn_file_actions_adddup2(fa, r->target != NULL ? r->open_fd : r->dup_fd, r->fd);
+        }
+    }
+    char **envp = c->envp != NULL ? c->envp : environ;
+    err = posix_spawn(&pid, file, fa, attr, c->argv, envp);
+    if (err == ENOEXEC) {  // No #! line, run it as a shell script like execvp() does
+        char *sh_argv[count_args(c) + 2];
+        script_argv(file, c, sh_argv);
+        if (posix_spawn(&pid, "/bin/sh", fa, attr, sh_argv, envp) == 0) {
+            err = 0;
+        }
+    }
+    if (fa != NULL) {
+        posix_spawn_file_actions_destroy(fa);
+    }
+    if (attr != NULL) {
+        posix_spawnattr_destroy(attr);
+    }
+    if (err != 0) {
+        *exec_errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Function to launch an external command, recording how long it took
+// in_fd and out_fd become the command's stdin and stdout unless they are -1
+// pgid -1 leaves the child in the shell's process group, 0 makes it lead a new group and
+// any other value adds it to that group; a new group is given the terminal tty unless it is -1
+// Returns the child's PID, -1 if no process could be created or -2 if the command could not be run
+pid_t spawn_command(const struct command *c, int in_fd, int out_fd, const struct placement *pl,
+                    pid_t pgid, int tty) {
+    // posix_spawn can't set affinity, memory policy or cgroup, placed jobs take the fork path
+    enum launch_path path = options[OPT_FORKEXEC].value || pl != NULL ? LAUNCH_FORK : LAUNCH_SPAWN;
+    uint64_t start = now_ns(), elapsed;
+    int exec_errno = ENOENT, cached, retry = 1;
+    const char *file;
+    pid_t pid = -1;
+
+    // Go straight to the cached location, searching PATH again if it went stale
+    while (1) {
+        uint64_t looked_up, spawn_start = now_ns();
+        if ((file = resolve_command(c->cmd, &cached)) == NULL) {
+            break;
+        }
+        looked_up = now_ns();
+        phases.lookup_ns += looked_up - spawn_start;
+        if (path == LAUNCH_FORK) {
+            pid = fork_command(file, c, in_fd, out_fd, pl, pgid, tty, &exec_errno);
+        } else {
+            pid = posix_spawn_command(file, c, in_fd, out_fd, pgid, tty, &exec_errno);
+            phases.spawn_ns += now_ns() - looked_up; // Returns once the child has exec'd
+        }
+        if (pid >= 0 || exec_errno != ENOENT || !cached || !retry--) {
+            break;
+        }
+        remove_path_entry(c->cmd); // The command moved or was deleted
+    }
+    if (pid < 0) {
+        // EAGAIN and ENOMEM mean the shell couldn't create a process at all
+        if (exec_errno == 0 || exec_errno == EAGAIN || exec_errno == ENOMEM) {
+            errno = exec_errno ? exec_errno : errno;
+            perror("Fork Failed");
+            return -1;
+        }
+        errno = exec_errno;
+        perror("Command Not Found");
+        return -2;
+    }
+
+    track_child(pid);
+
+    // Record the latency of the launch path that was used
+    elapsed = now_ns() - start;
+    struct spawn_stats *st = &spawn_stats[path];
+    st->count++;
+    st->total_ns += elapsed;
+    st->min_ns = MIN(st->min_ns, elapsed);
+    st->max_ns = MAX(st->max_ns, elapsed);
+    record_time(STAT_LAUNCH, elapsed);
+    return pid;
+}
+
+// Enumeration for built-in shell commands
+enum built_ins {
+    EXIT,     // Exit command
+    PID,      // Print the current process ID
+    PPID,     // Print the parent process ID
+    CD,       // Change directory command
+    PWD,      // Print working directory command
+    JOBS,     // List background jobs
+    SET,      // Show or change shell options
+    SPAWNSTAT,// Print launch latency statistics
+    HASH,     // Show or change the command location cache
+    HISTORY,  // List or search the command history
+    FG,       // Continue a job in the foreground
+    BG,       // Continue a stopped job in the background
+    KILL,     // Send a signal to jobs or processes
+    EXPORT,   // Export variables to the environment of commands
+    UNSET,    // Remove variables
+    STATS,    // Print or reset hot-path statistics
+    REDIRECT, // A builtin's redirection couldn't be set up
+    NOT       // No built-in command executed
+};
+
+// Exit status of the last builtin, handlers set it when they fail
+int built_in_status = 0;
+
+// Function to signal to exit the shell
+enum built_ins built_in_exit(const struct command *c, FILE *out) {
+    return EXIT;
+}
+
+// Function to print the shell's process ID, the same in a pipeline stage run by a copy of the shell
+enum built_ins built_in_pid(const struct command *c, FILE *out) {
+    fprintf(out, "Shell pid: %d\n", shell_pid);
+    return PID;
+}
+
+// Function to print the shell's parent process ID
+enum built_ins built_in_ppid(const struct command *c, FILE *out) {
+    fprintf(out, "Shell's Parent pid: %d\n", shell_ppid);
+    return PPID;
+}
+
+// Function to change the current directory
+enum built_ins built_in_cd(const struct command *c, FILE *out) {
+    int fail = 0;
+    // If an argument is provided, attempt to change to that directory; otherwise, change to HOME
+    if(c->argv[1] != NULL) {
+        fail = chdir(c->argv[1]);
+    } 
+    else if (getenv("HOME") != NULL) {
+        fail = chdir(getenv("HOME"));
+    }
+    else {
+        errno = ENOENT; // HOME can be unset now
+        fail = 1;
+    }
+    // If changing directory fails, print an error message
+    if (fail) {
+        perror("cd");
+        built_in_status = 1;
+    }
+    return CD;
+}
+
+// Function to print the current working directory
+enum built_ins built_in_pwd(const struct command *c, FILE *out) {
+    char cwd[MAXPATHLEN];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        fprintf(out, "%s\n", cwd);
+    } else {
+        perror("cd");
+        built_in_status = 1;
+    }
+    return PWD;
+}
+
+// Function to list all background jobs, with jobs -l also their processes and usage
+enum built_ins built_in_jobs(const struct command *c, FILE *out) {
+    size_t i, len = child_jobs != NULL ? child_jobs->len : 0; // No job list before the first job
+    int long_format = c->argv[1] != NULL && !strcmp(c->argv[1], "-l");
+    for(i = 0; i < len; i++){
+        struct job *curr = &child_jobs->jobs[i];
+        const char *state = curr->finished ? "done" : job_is_stopped(curr) ? "stopped" : "running";
+        if (!long_format) {
+            fprintf(out, "[%d] %d %s%s\n", curr->id, curr->pid, curr->name,
+                    job_is_stopped(curr) ? " (stopped)" : "");
+            continue;
+        }
+        fprintf(out, "[%d] %d %s\n    %s %zu/%zu pids", curr->id, curr->pid, curr->name,
+                state, curr->running, curr->nprocs);
+        for (size_t k = 0; k < curr->nprocs; k++) {
+            fprintf(out, " %d", abs(curr->pids[k])); // Reaped processes are stored negated
+        }
+        fprintf(out, "\n    ");
+        print_usage(out, &curr->usage);
+        fprintf(out, "\n");
+    }
+    return JOBS;
+}
+
+// Function to list the shell options or switch them with -o name / +o name
+enum built_ins built_in_set(const struct command *c, FILE *out) {
+    if (c->argv[1] == NULL) {
+        for (int i = 0; i < NUM_OPTIONS; i++) {
+            fprintf(out, "%-12s %s\n", options[i].name, options[i].value ? "on" : "off");
+        }
+        return SET;
+    }
+    for (int i = 1; c->argv[i] != NULL; i += 2) {
+        int on = !strcmp(c->argv[i], "-o"), found = 0;
+        if ((!on && strcmp(c->argv[i], "+o")) || c->argv[i + 1] == NULL) {
+            fprintf(stderr, "set: usage: set [-o|+o option]...\n");
+            built_in_status = 2;
+            break;
+        }
+        for (int o = 0; o < NUM_OPTIONS; o++) {
+            if (!strcmp(c->argv[i + 1], options[o].name)) {
+                options[o].value = on;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "set: %s: unknown option\n", c->argv[i + 1]);
+            built_in_status = 1;
+        }
+    }
+    return SET;
+}
+
+// Function to print how long launching external commands took
+enum built_ins built_in_spawnstat(const struct command *c, FILE *out) {
+    for (int i = 0; i < NUM_LAUNCH_PATHS; i++) {
+        struct spawn_stats *st = &spawn_stats[i];
+        if (st->count == 0) {
+            fprintf(out, "%-12s no launches\n", st->name);
+            continue;
+        }
+        fprintf(out, "%-12s %zu launches, avg %.1f us, min %.1f us, max %.1f us\n", st->name, st->count,
+               st->total_ns / 1e3 / st->count, st->min_ns / 1e3, st->max_ns / 1e3);
+    }
+    return SPAWNSTAT;
+}
+
+// Function to list cached command locations, or -r to clear them, -d to drop some,
+// and names to look up now
+enum built_ins built_in_hash(const struct command *c, FILE *out) {
+    validate_path_cache();
+    if (c->argv[1] == NULL) {
+        if (path_cache.count == 0) {
+            fprintf(out, "hash: hash table empty\n");
+            return HASH;
+        }
+        fprintf(out, "hits\tcommand\n");
+        for (size_t i = 0; i <= path_cache.mask; i++) {
+            struct path_entry *e = &path_cache.slots[i];
+            if (e->name != NULL) {
+                fprintf(out, "%4u\t%s\n", e->hits, e->path);
+            }
+        }
+        return HASH;
+    }
+    int drop = 0;
+    for (int i = 1; c->argv[i] != NULL; i++) {
+        char buf[MAXPATHLEN];
+        if (!strcmp(c->argv[i], "-r")) {
+            clear_path_cache();
+        } else if (!strcmp(c->argv[i], "-d")) {
+            drop = 1;
+        } else if (drop) {
+            remove_path_entry(c->argv[i]);
+        } else if (strchr(c->argv[i], '/') == NULL && search_path(c->argv[i], buf, sizeof(buf)) != NULL) {
+            insert_path_entry(c->argv[i], buf);
+        } else if (strchr(c->argv[i], '/') == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", c->argv[i]);
+            built_in_status = 1;
+        }
+    }
+    return HASH;
+}
+
+// Function to list the command history: history [count] lists the last count entries,
+// history -s text lists the entries containing text from the newest back (reverse search)
+enum built_ins built_in_history(const struct command *c, FILE *out) {
+    const char *text = NULL, *entry;
+    size_t first = 0;
+    int len;
+
+    if (sync_history() < 0) {
+        fprintf(stderr, "history: no history file\n");
+        built_in_status = 1;
+        return HISTORY;
+    }
+    if (c->argv[1] != NULL && !strcmp(c->argv[1], "-s")) {
+        if ((text = c->argv[2]) == NULL) {
+            fprintf(stderr, "history: usage: history [count] | history -s text\n");
+            built_in_status = 2;
+            return HISTORY;
+        }
+        for (size_t i = history.len; i-- > 0; ) {
+            entry = history_entry(i, &len);
+            if (memmem(entry, len, text, strlen(text)) != NULL) {
+                fprintf(out, "%5zu  %.*s\n", i + 1, len, entry);
+            }
+        }
+        return HISTORY;
+    }
+    if (c->argv[1] != NULL) {
+        char *end;
+        long count = strtol(c->argv[1], &end, 10);
+        if (*end != '\0' || count < 0) {
+            fprintf(stderr, "history: %s: count expected\n", c->argv[1]);
+            built_in_status = 1;
+            return HISTORY;
+        }
+        first = (size_t) count < history.len ? history.len - count : 0;
+    }
+    for (size_t i = first; i < history.len; i++) {
+        entry = history_entry(i, &len);
+        fprintf(out, "%5zu  %.*s\n", i + 1, len, entry);
+    }
+    return HISTORY;
+}
+
+// Function to find the job an argument of a job control builtin names: %n for job number n,
+// the PID of one of its running processes, or %, %%, %+ or no argument for the most recent job
+// Returns its position in the job list, or -1 if there is no such job
+ssize_t find_job_arg(const char *arg) {
+    size_t len = child_jobs != NULL ? child_jobs->len : 0, latest = len;
+    struct job_slot *slot;
+    char *end;
+    long n;
+
+    if (arg == NULL || !strcmp(arg, "%") || !strcmp(arg, "%%") || !strcmp(arg, "%+")) {
+        for (size_t i = 0; i < len; i++) {
+            if (latest == len || child_jobs->jobs[i].id > child_jobs->jobs[latest].id) {
+                latest = i;
+            }
+        }
+        return latest < len ? (ssize_t) latest : -1;
+    }
+    n = strtol(arg[0] == '%' ? &arg[1] : arg, &end, 10);
+    if (*end != '\0' || end == arg || n <= 0) {
+        return -1;
+    }
+    if (arg[0] == '%') {
+        for (size_t i = 0; i < len; i++) {
+            if (child_jobs->jobs[i].id == n) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    return (slot = find_job_slot(n)) != NULL ? (ssize_t) slot->job - 1 : -1;
+}
+
+// Function to take a job out of the job list, copying what it references into the command arena
+// since removing the last job recycles the list's arena
+void take_job(size_t i, struct job *j) {
+    *j = child_jobs->jobs[i];
+    move_job_names(j, &command_arena);
+    free_job(i);
+}
+
+int run_in_foreground(struct job *j, int cont);
+
+// Function to continue a job in the foreground and wait for it: fg [%n | pid]
+enum built_ins built_in_fg(const struct command *c, FILE *out) {
+    ssize_t i = find_job_arg(c->argv[1]);
+    struct job j;
+    int status;
+
+    if (i < 0) {
+        fprintf(stderr, "fg: %s: no such job\n", c->argv[1] != NULL ? c->argv[1] : "current");
+        built_in_status = 1;
+        return FG;
+    }
+    take_job(i, &j);
+    fprintf(out, "%s\n", j.name);
+    fflush(out);
+    status = run_in_foreground(&j, 1);
+    built_in_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return FG;
+}
+
+// Function to continue stopped jobs in the background: bg [%n | pid]...
+enum built_ins built_in_bg(const struct command *c, FILE *out) {
+    for (size_t i = 1; ; i++) {
+        ssize_t pos = find_job_arg(c->argv[i]);
+        if (pos < 0) {
+            fprintf(stderr, "bg: %s: no such job\n", c->argv[i] != NULL ? c->argv[i] : "current");
+            built_in_status = 1;
+        } else {
+            struct job *j = &child_jobs->jobs[pos];
+            if (!j->finished) {
+                signal_job(j, SIGCONT);
+            }
+            fprintf(out, "[%d] %s &\n", j->id, j->name);
+        }
+        if (c->argv[i] == NULL || c->argv[i + 1] == NULL) {
+            break;
+        }
+    }
+    return BG;
+}
+
+// Signal names the kill builtin accepts, with or without the SIG prefix
+const struct signal_name {
+    const char *name;
+    int sig;
+} signal_names[] = {
+    { "HUP", SIGHUP },   { "INT", SIGINT },   { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+    { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+};
+
+// Function to parse a signal number or name, -1 if it is unknown
+int parse_signal(const char *arg) {
+    char *end;
+    long sig = strtol(arg, &end, 10);
+
+    if (end != arg && *end == '\0') {
+        return sig > 0 && sig < NSIG ? (int) sig : -1;
+    }
+    if (!strncmp(arg, "SIG", 3)) {
+        arg += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (!strcmp(arg, signal_names[i].name)) {
+            return signal_names[i].sig;
+        }
+    }
+    return -1;
+}
+
+// Function to send a signal, SIGTERM by default, to jobs or processes: kill [-signal] %n | pid...
+// A job is signalled as a whole, with one killpg() if it has its own process group
+enum built_ins built_in_kill(const struct command *c, FILE *out) {
+    int sig = SIGTERM;
+    size_t i = 1;
+
+    if (c->argv[i] != NULL && c->argv[i][0] == '-') {
+        if ((sig = parse_signal(&c->argv[i][1])) < 0) {
+            fprintf(stderr, "kill: %s: unknown signal\n", &c->argv[i][1]);
+            built_in_status = 1;
+            return KILL;
+        }
+        i++;
+    }
+    if (c->argv[i] == NULL) {
+        fprintf(stderr, "kill: usage: kill [-signal] %%job | pid...\n");
+        built_in_status = 2;
+        return KILL;
+    }
+    for (; c->argv[i] != NULL; i++) {
+        const char *arg = c->argv[i];
+        char *end;
+        int fail = 0;
+        if (arg[0] == '%') {
+            ssize_t pos = find_job_arg(arg);
+            if (pos < 0) {
+                fprintf(stderr, "kill: %s: no such job\n", arg);
+                built_in_status = 1;
+                continue;
+            }
+            // A finished job's process group may belong to someone else by now
+            if (!child_jobs->jobs[pos].finished) {
+                fail = signal_job(&child_jobs->jobs[pos], sig);
+            }
+        } else {
+            long pid = strtol(arg, &end, 10);
+            if (*end != '\0' || end == arg || pid <= 0) {
+                fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", arg);
+                built_in_status = 1;
+                continue;
+            }
+            fail = kill(pid, sig);
+        }
+        if (fail < 0) {
+            fprintf(stderr, "kill: %s: %s\n", arg, strerror(errno));
+            built_in_status = 1;
+        }
+    }
+    return KILL;
+}
+
+// Function to export variables, setting the ones given as NAME=value
+// Without arguments the environment commands get is listed
+enum built_ins built_in_export(const struct command *c, FILE *out) {
+    if (c->argv[1] == NULL) {
+        sync_environ();
+        for (char **e = environ; *e != NULL; e++) {
+            fprintf(out, "export %s\n", *e);
+        }
+        return EXPORT;
+    }
+    for (int i = 1; c->argv[i] != NULL; i++) {
+        size_t len = variable_name_len(c->argv[i]);
+        struct variable *v;
+        if (len == 0 || (c->argv[i][len] != '=' && c->argv[i][len] != '\0')) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", c->argv[i]);
+            built_in_status = 1;
+        } else if (c->argv[i][len] == '=') {
+            const char *value = c->argv[i] + len + 1;
+            set_variable(c->argv[i], len, value, strlen(value), 1);
+        } else if ((v = find_variable(c->argv[i], len)) != NULL) {
+            variables.dirty |= !v->exported;
+            v->exported = 1;
+        } else {
+            set_variable(c->argv[i], len, "", 0, 1);
+        }
+    }
+    return EXPORT;
+}
+
+// Function to remove variables, from the environment of commands as well
+enum built_ins built_in_unset(const struct command *c, FILE *out) {
+    for (int i = 1; c->argv[i] != NULL; i++) {
+        size_t len = variable_name_len(c->argv[i]);
+        if (len == 0 || c->argv[i][len] != '\0') {
+            fprintf(stderr, "unset: %s: not a valid identifier\n", c->argv[i]);
+            built_in_status = 1;
+        } else {
+            unset_variable(c->argv[i], len);
+        }
+    }
+    return UNSET;
+}
+
+// Function to print the hot-path statistics: a latency line and a histogram per path,
+// then the counters
+void print_stats(FILE *out) {
+    fprintf(out, "%-8s %10s %10s %10s %10s %10s\n", "path", "count", "avg us", "p50 us", "p99 us", "max us");
+    for (int i = 0; i < NUM_STATS; i++) {
+        const struct stat_timer *t = &stat_timers[i];
+        if (t->count == 0) {
+            fprintf(out, "%-8s %10d\n", t->name, 0);
+            continue;
+        }
+        fprintf(out, "%-8s %10" PRIu64 " %10.1f %10.0f %10.0f %10.1f\n", t->name, t->count,
+                t->total_ns / 1e3 / t->count, stat_percentile(t, 50), stat_percentile(t, 99), t->max_ns / 1e3);
+    }
+    // Bucket labels are upper bounds, the last bucket is open-ended
+    for (int i = 0; i < NUM_STATS; i++) {
+        const struct stat_timer *t = &stat_timers[i];
+        if (t->count == 0) {
+            continue;
+        }
+        fprintf(out, "%-8s", t->name);
+        for (int b = 0; b < STAT_BUCKETS; b++) {
+            if (t->buckets[b] != 0 && b + 1 < STAT_BUCKETS) {
+                fprintf(out, " <%lluus:%" PRIu64, 1ull << b, t->buckets[b]);
+            } else if (t->buckets[b] != 0) {
+                fprintf(out, " more:%" PRIu64, t->buckets[b]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "lines %" PRIu64 ", children %" PRIu64 ", arena allocations %" PRIu64 " (%" PRIu64 " bytes, %" PRIu64
+            " chunks), dir cache %zu hits %zu scans, environ %zu rebuilds\n",
+            stat_counters.lines, stat_counters.children, stat_counters.arena_allocs, stat_counters.arena_bytes,
+            stat_counters.arena_chunks, dir_cache.hits, dir_cache.scans, variables.rebuilds);
+}
+
+// Function to print the hot-path statistics, or to reset them with -r
+enum built_ins built_in_stats(const struct command *c, FILE *out) {
+    if (c->argv[1] != NULL && !strcmp(c->argv[1], "-r") && c->argv[2] == NULL) {
+        for (int i = 0; i < NUM_STATS; i++) {
+            stat_timers[i] = (struct stat_timer) { .name = stat_timers[i].name };
+        }
+        memset(&stat_counters, 0, sizeof(stat_counters));
+        return STATS;
+    }
+    if (c->argv[1] != NULL) {
+        fprintf(stderr, "stats: usage: stats [-r]\n");
+        built_in_status = 1;
+        return STATS;
+    }
+    print_stats(out);
+    return STATS;
+}
+
+// Entry of the builtin dispatch table
+struct built_in {
+    const char *name;   // Command name, NULL if the slot is empty
+    enum built_ins (*run)(const struct command *c, FILE *out); // Handler, output goes to out
+};
+
+// Number of slots in the builtin table, a power of two
+#define BUILT_IN_SLOTS 32
+// Longest builtin name, longer commands are never builtins
+#define BUILT_IN_MAX_LEN 9
+// Slot of a name from its first, second and last character and its length
+// A builtin taking a slot already in use fails the build, see the table below
+#define BUILT_IN_SLOT(first, second, last, len) \
+    (((unsigned) (first) + (unsigned) (second) + 12u * (unsigned) (last) + (len)) & (BUILT_IN_SLOTS - 1))
+
+// Builtin dispatch table, a perfect hash: a command can only be the builtin in its slot
+// Two names in one slot would make the later initializer silently win, so that is an error
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+const struct built_in built_in_table[BUILT_IN_SLOTS] = {
+    [BUILT_IN_SLOT('e', 'x', 't', 4)] = { "exit",      built_in_exit },
+    [BUILT_IN_SLOT('p', 'i', 'd', 3)] = { "pid",       built_in_pid },
+    [BUILT_IN_SLOT('p', 'p', 'd', 4)] = { "ppid",      built_in_ppid },
+    [BUILT_IN_SLOT('c', 'd', 'd', 2)] = { "cd",        built_in_cd },
+    [BUILT_IN_SLOT('p', 'w', 'd', 3)] = { "pwd",       built_in_pwd },
+    [BUILT_IN_SLOT('j', 'o', 's', 4)] = { "jobs",      built_in_jobs },
+    [BUILT_IN_SLOT('s', 'e', 't', 3)] = { "set",       built_in_set },
+    [BUILT_IN_SLOT('s', 'p', 't', 9)] = { "spawnstat", built_in_spawnstat },
+    [BUILT_IN_SLOT('h', 'a', 'h', 4)] = { "hash",      built_in_hash },
+    [BUILT_IN_SLOT('f', 'g', 'g', 2)] = { "fg",        built_in_fg },
+    [BUILT_IN_SLOT('b', 'g', 'g', 2)] = { "bg",        built_in_bg },
+    [BUILT_IN_SLOT('k', 'i', 'l', 4)] = { "kill",      built_in_kill },
+    [BUILT_IN_SLOT('h', 'i', 'y', 7)] = { "history",   built_in_history },
+    [BUILT_IN_SLOT('e', 'x', 't', 6)] = { "export",    built_in_export },
+    [BUILT_IN_SLOT('u', 'n', 't', 5)] = { "unset",     built_in_unset },
+    [BUILT_IN_SLOT('s', 't', 's', 5)] = { "stats",     built_in_stats },
+};
+#pragma GCC diagnostic pop
+
+// Function to find the builtin a command names, NULL for external commands
+// Costs one bounded length scan, one table load and one string comparison
+const struct built_in *find_built_in(const char *name) {
+    size_t len = strnlen(name, BUILT_IN_MAX_LEN + 1);
+    const struct built_in *b;
+
+    if (len == 0 || len > BUILT_IN_MAX_LEN) {
+        return NULL;
+    }
+    b = &built_in_table[BUILT_IN_SLOT(name[0], name[1], name[len - 1], len)];
+    return b->name != NULL && !strcmp(name, b->name) ? b : NULL;
+}
+
+// Function to check whether a command is run by the shell itself
+int is_built_in(const char *name) {
+    return find_built_in(name) != NULL;
+}
+
+// Function to execute built-in shell commands or identify if a command is not built-in
+// Output goes to out, which is stdout unless the builtin is a pipeline stage
+enum built_ins run_built_in(const struct command *c, FILE *out) {
+    const struct built_in *b = find_built_in(c->cmd);
+    enum built_ins ret;
+    uint64_t start;
+
+    built_in_status = 0;
+    // If the command isn't a builtin, return NOT to have it run as an external command
+    if (b == NULL) {
+        return NOT;
+    }
+    start = now_ns();
+    ret = b->run(c, out);
+    record_time(STAT_BUILTIN, now_ns() - start);
+    return ret;
+}
+
+// Function to run a builtin with its redirections applied to the shell's own descriptors
+// The descriptors are restored afterwards; a redirected stdout takes the place of out
+enum built_ins run_redirected_built_in(const struct command *c, FILE *out) {
+    enum built_ins ret;
+    int saved[10];
+
+    if (c->redirs == NULL || !is_built_in(c->cmd)) {
+        return run_built_in(c, out);
+    }
+    if (open_redirects(c) < 0) {
+        return REDIRECT;
+    }
+    fflush(out);
+    fflush(stdout);
+    // Keep the shell's descriptors out of the way of the redirections
+    for (int fd = 0; fd < 10; fd++) {
+        saved[fd] = -2; // Not redirected
+    }
+    for (const struct redirect *r = c->redirs; r != NULL; r = r->next) {
+        if (saved[r->fd] == -2) {
+            saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10); // -1 if it wasn't open
+        }
+        if (r->fd == STDOUT_FILENO) {
+            out = stdout;
+        }
+    }
+    if (apply_redirects(c) < 0) {
+        perror("dup2");
+        ret = REDIRECT;
+    } else {
+        ret = run_built_in(c, out);
+    }
+    fflush(out);
+    fflush(stdout);
+    for (int fd = 0; fd < 10; fd++) {
+        if (saved[fd] >= 0) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        } else if (saved[fd] == -1) {
+            close(fd);
+        }
+    }
+    clearerr(stdin);
+    clearerr(stdout);
+    close_redirects(c);
+    return ret;
+}
+
+// Function to copy a stream from one file descriptor to several others until end of input
+// Pipes are forwarded with tee()/splice() so the data never passes through user space
+int forward_data(int in_fd, const int *out_fds, size_t n) {
+    char buf[1 << 16];
+    ssize_t got, put;
+    int zero_copy = 1;
+
+    while (1) {
+        // Zero-copy path: duplicate the input into at most one pipe, then move it into the last output
+        if (zero_copy && n <= 2) {
+            got = n == 2 ? tee(in_fd, out_fds[0], sizeof(buf), 0)
+                         : splice(in_fd, NULL, out_fds[0], NULL, sizeof(buf), SPLICE_F_MOVE);
+            if (got == 0) {
+                return 0; // End of input
+            } else if (got > 0 && n == 2) {
+                // Consume exactly what was duplicated
+                for (ssize_t left = got; left > 0; left -= put) {
+                    if ((put = splice(in_fd, NULL, out_fds[1], NULL, left, SPLICE_F_MOVE)) > 0) {
+                        continue;
+                    } else if (put < 0 && errno == EINTR) {
+                        put = 0;
+                        continue;
+                    } else if (put == 0 || errno != EINVAL) {
+                        return -1;
+                    }
+                    // Files opened with O_APPEND can't be spliced into, copy the rest of the chunk
+                    for (ssize_t off = 0; off < left; off += got) {
+                        if ((got = read(in_fd, buf + off, left - off)) <= 0) {
+                            return -1;
+                        }
+                    }
+                    for (ssize_t off = 0; off < left; off += put) {
+                        if ((put = write(out_fds[1], buf + off, left - off)) < 0) {
+                            return -1;
+                        }
+                    }
+                    zero_copy = 0;
+                    break;
+                }
+                continue;
+            } else if (got > 0) {
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EINVAL) {
+                return -1;
+            }
+            zero_copy = 0; // These file types can't be spliced, copy from now on
+        }
+        if ((got = read(in_fd, buf, sizeof(buf))) == 0) {
+            return 0;
+        } else if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (size_t k = 0; k < n; k++) {
+            for (ssize_t off = 0; off < got; off += put) {
+                if ((put = write(out_fds[k], buf + off, got - off)) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+}
+
+// Function to tell whether the shell's own tee understands a command's arguments: files and a leading -a
+// Other options, and redirections, are left to the real tee rather than taken for file names
+int is_simple_tee(const struct command *c) {
+    if (c->redirs != NULL) {
+        return 0;
+    }
+    for (size_t i = 1; c->argv[i] != NULL; i++) {
+        if (c->argv[i][0] == '-' && (i > 1 || strcmp(c->argv[i], "-a"))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to run the tee builtin as the last stage of a pipeline: copy stdin to stdout and files
+// Returns the stage's wait status: like tee(1) it exits 1 if a file couldn't be opened or written
+int run_tee(const struct command *c, int in_fd, int out_fd) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, out_fds[2], nfiles = 0, status = 0, err;
+    size_t i = 1;
+    int *fds;
+
+    if (c->argv[1] != NULL && !strcmp(c->argv[1], "-a")) {
+        flags = (flags & ~O_TRUNC) | O_APPEND; // Append to the files instead of overwriting
+        i++;
+    }
+    // Room for stdout and every file
+    for (size_t k = i; c->argv[k] != NULL; k++) {
+        nfiles++;
+    }
+    fds = arena_alloc(&command_arena, sizeof(int) * (nfiles + 1));
+    fds[0] = out_fd;
+    nfiles = 0;
+    for (; c->argv[i] != NULL; i++) {
+        int fd = open(c->argv[i], flags, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "tee: %s: %s\n", c->argv[i], strerror(errno));
+            status = W_EXITCODE(1, 0);
+            continue;
+        }
+        fds[++nfiles] = fd;
+    }
+    // Files first, so stdout is the consuming end when there is a single file
+    if (nfiles == 1) {
+        out_fds[0] = fds[0];
+        out_fds[1] = fds[1];
+        err = forward_data(in_fd, out_fds, 2) < 0 ? errno : 0;
+    } else {
+        err = forward_data(in_fd, fds, nfiles + 1) < 0 ? errno : 0;
+    }
+    if (err == EPIPE) {
+        status = SIGPIPE; // Where tee(1) would have been killed by the closed reader
+    } else if (err != 0) {
+        fprintf(stderr, "tee: %s\n", strerror(err));
+        status = W_EXITCODE(1, 0);
+    }
+    for (int k = 1; k <= nfiles; k++) {
+        if (close(fds[k]) < 0 && status == 0) {
+            perror("tee");
+            status = W_EXITCODE(1, 0);
+        }
+    }
+    return status;
+}
+
+// Enumeration for how a pipeline stage is run
+enum stage_kind {
+    STAGE_EXTERNAL,     // In a child process
+    STAGE_BUILTIN,      // In the shell, writing to the stage's output
+    STAGE_TEE           // In the shell, forwarding the previous stage's output
+};
+
+// Function to decide how a stage of a pipeline is run
+enum stage_kind classify_stage(const struct pipeline *p, size_t s, int background) {
+    if (is_built_in(p->stages[s].cmd)) {
+        return STAGE_BUILTIN;
+    }
+    // tee forwards data in the shell only where it can't hold up other in-shell stages:
+    // at the end of a foreground pipeline of external commands
+    if (!strcmp(p->stages[s].cmd, "tee") && s > 0 && s + 1 == p->len && !background &&
+        is_simple_tee(&p->stages[s])) {
+        for (size_t k = 0; k < s; k++) {
+            if (is_built_in(p->stages[k].cmd)) {
+                return STAGE_EXTERNAL;
+            }
+        }
+        return STAGE_TEE;
+    }
+    return STAGE_EXTERNAL;
+}
+
+// Function to run a builtin or tee stage in a copy of the shell that joins the job's process group
+// With job control the shell must not be a stage itself: it would block on a pipe of a stopped job
+// and never get back to the prompt. Of the pipes only the stage's own ends are kept
+// Returns the child's PID or -1 if it could not be created
+pid_t fork_shell_stage(const struct pipeline *p, size_t s, enum stage_kind kind, const int *in_fds,
+                       const int *out_fds, const struct placement *pl, pid_t pgid, int tty) {
+    enum built_ins ret;
+    pid_t pid;
+
+    fflush(stdout); // The child must not inherit and later flush buffered output
+    if ((pid = fork()) < 0) {
+        perror("Fork Failed");
+        return -1;
+    } else if (pid == 0) {  // Child process: runs the stage and exits with its status
+        setpgid(0, pgid);
+        if (tty >= 0) {
+            tcsetpgrp(tty, getpgrp());
+        }
+        if (shell_terminal >= 0) {
+            default_job_signals();
+        }
+        sigprocmask(SIG_SETMASK, &shell_sigmask, NULL); // SIGCHLD is held while a group is launched
+        detach_events();
+        for (size_t k = 0; k < p->len; k++) {
+            if (in_fds[k] >= 0 && (k != s || kind == STAGE_BUILTIN)) {
+                close(in_fds[k]); // Builtins never read their input
+            }
+            if (out_fds[k] >= 0 && k != s) {
+                close(out_fds[k]);
+            }
+        }
+        if ((out_fds[s] >= 0 && dup2(out_fds[s], STDOUT_FILENO) < 0) || (pl != NULL && apply_placement(pl) < 0)) {
+            perror("dup2");
+            _exit(127);
+        }
+        if (kind == STAGE_TEE) {
+            int status = run_tee(&p->stages[s], in_fds[s], STDOUT_FILENO);
+            _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        }
+        ret = run_redirected_built_in(&p->stages[s], stdout);
+        fflush(stdout);
+        _exit(ret == REDIRECT ? 1 : built_in_status);
+    }
+    track_child(pid);
+    return pid;
+}
+
+// Function to launch every stage of a pipeline concurrently, connected by pipes
+// External stages are started first, then builtin stages run in the shell writing
+// straight into their pipes; with job control they run in copies of the shell instead
+// The job describing the processes is filled in, its memory lives until the pipeline is freed
+// Returns the number of processes started or -1 if no process could be created
+ssize_t launch_pipeline(const struct pipeline *p, int background, struct job *j) {
+    int *in_fds = arena_alloc(&command_arena, sizeof(int) * p->len);
+    int *out_fds = arena_alloc(&command_arena, sizeof(int) * p->len);
+    const struct placement *place = p->place;
+    int monitor = options[OPT_MONITOR].value; // Every job gets a process group of its own
+    int in_shell = !monitor || p->len == 1;   // Builtin and tee stages run in the shell itself
+    struct placement spread, limited;
+    size_t name_len = 0;
+    ssize_t failure = 0;
+    char *name;
+    int fds[2];
+
+    // Background jobs without a placement of their own take the next spot in spread mode
+    if (place == NULL && background && options[OPT_SPREAD].value && next_spread_placement(&spread) == 0) {
+        place = &spread;
+    }
+
+    // Children write straight to the shell's output, so what the shell printed goes first
+    fflush(stdout);
+
+    // The job is named after the commands of its stages
+    for (size_t s = 0; s < p->len; s++) {
+        name_len += strlen(p->stages[s].cmd) + 3;
+    }
+    name = arena_alloc(&command_arena, name_len);
+    name[0] = '\0';
+    j->name = name;
+    j->pids = arena_alloc(&command_arena, sizeof(pid_t) * p->len);
+    j->stopped = memset(arena_alloc(&command_arena, p->len), 0, p->len);
+    j->nstopped = 0;
+    j->id = 0;
+    j->pgid = 0;
+    j->nprocs = 0;
+    j->status_pid = 0;
+    j->status = j->state_status = W_EXITCODE(127, 0); // Status of a last stage that couldn't be run
+    j->finished = j->notify = 0;
+    j->cgroup = NULL;
+    memset(&j->usage, 0, sizeof(j->usage));
+    j->usage.start_ns = now_ns();
+
+    // Every process of a limited job starts in its new cgroup
+    if (place != NULL && place->limits != NULL) {
+        limited = *place;
+        if ((j->cgroup = create_job_cgroup(place->limits, &limited.procs_fd)) == NULL) {
+            j->status = W_EXITCODE(1, 0);
+            return 0;
+        }
+        place = &limited;
+    }
+
+    // Every stage but the last writes into a pipe read by the next one
+    in_fds[0] = out_fds[p->len - 1] = -1;
+    for (size_t s = 0; s + 1 < p->len; s++) {
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            for (size_t k = 0; k < s; k++) {
+                close(out_fds[k]);
+                close(in_fds[k + 1]);
+            }
+            return -1;
+        }
+        tune_pipe(fds[1]);
+        out_fds[s] = fds[1];
+        in_fds[s + 1] = fds[0];
+    }
+
+    // The first process leads the job's process group; until every stage has joined it,
+    // SIGCHLD is held so an early exit can't get the leader reaped and the group dissolved
+    sigset_t held;
+    sigemptyset(&held);
+    sigaddset(&held, SIGCHLD);
+    if (monitor) {
+        sigprocmask(SIG_BLOCK, &held, NULL);
+    }
+    for (size_t s = 0; s < p->len; s++) {
+        const struct command *c = &p->stages[s];
+        pid_t pid = 0;
 
-// Function to remove a job by its PID
-void free_job_by_pid(pid_t pid) {
-    if (child_jobs != NULL && child_jobs->len > 0) {
-        for (size_t i = 0, len = child_jobs->len; i < len; i++) {
-            struct job *curr_job = &child_jobs->jobs[i];
-            if (curr_job->pid == pid) {
-                free(curr_job->name); // Free the dynamically allocated job name
-                // Shift the last job to the current position if not the last one
-                if (i < len - 1) {
-                    memcpy(curr_job, &child_jobs->jobs[len - 1], sizeof(struct job));
+        enum stage_kind kind = classify_stage(p, s, background);
+        name += sprintf(name, s ? " | %s" : "%s", c->cmd);
+        if (kind != STAGE_EXTERNAL && in_shell) {
+            if (s + 1 == p->len) {
+                j->status = W_EXITCODE(0, 0); // The shell runs the last stage itself
+            }
+            continue;
+        }
+        if (failure == 0 && kind != STAGE_EXTERNAL) {
+            pid = fork_shell_stage(p, s, kind, in_fds, out_fds, place, j->pgid,
+                                   !background && j->pgid == 0 ? shell_terminal : -1);
+        } else if (failure == 0 && open_redirects(c) == 0) {
+            pid = spawn_command(c, in_fds[s], out_fds[s], place, monitor ? j->pgid : -1,
+                                monitor && !background && j->pgid == 0 ? shell_terminal : -1);
+            close_redirects(c); // The child has its own copies
+        }
+        // The child holds its own copies of the pipe ends
+        if (in_fds[s] >= 0) {
+            close(in_fds[s]);
+        }
+        if (out_fds[s] >= 0) {
+            close(out_fds[s]);
+        }
+        in_fds[s] = out_fds[s] = -1;
+        if (pid == -1) {
+            failure = -1; // Stop creating processes, but still close every pipe
+        } else if (pid > 0) {
+            // posix_spawn() only returns once the child runs the command, so a fast command's first
+            // output can come before this notice; in the child it would be lost on exec with stdout a pipe
+            printf(">>> [%d] %s\n", pid, c->cmd);
+            j->pids[j->nprocs++] = pid;
+            if (monitor && j->pgid == 0) {
+                j->pgid = pid;
+            }
+            emit_spawn_event(pid, j, c->cmd);
+            if (s + 1 == p->len) {
+                j->status_pid = pid;
+            }
+        }
+    }
+
+    if (monitor) {
+        sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+    }
+    if (place == &limited) {
+        close(limited.procs_fd);
+        if (j->nprocs == 0) {
+            rmdir(j->cgroup); // Nothing ever ran in it
+            job_cgroups.live--;
+            j->cgroup = NULL;
+        }
+    }
+
+    // Builtins never read their input, and nothing would read it while an earlier in-shell stage
+    // writes: closing it makes that stage fail with EPIPE instead of filling the pipe forever
+    for (size_t s = 0; failure == 0 && s < p->len; s++) {
+        if (in_fds[s] >= 0 && classify_stage(p, s, background) == STAGE_BUILTIN) {
+            close(in_fds[s]);
+            in_fds[s] = -1;
+        }
+    }
+
+    // Run the stages the shell handles itself, a closed reader must not kill the shell
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old;
+    sigaction(SIGPIPE, &ign, &old);
+    for (size_t s = 0; s < p->len; s++) {
+        const struct command *c = &p->stages[s];
+        switch (failure == 0 && in_shell ? classify_stage(p, s, background) : STAGE_EXTERNAL) {
+            case STAGE_BUILTIN: {
+                FILE *out = out_fds[s] >= 0 ? fdopen(out_fds[s], "w") : stdout;
+                if (out != NULL) {
+                    run_redirected_built_in(c, out); // exit in a pipeline doesn't end the shell
+                    if (out != stdout) {
+                        fclose(out);
+                        out_fds[s] = -1;
+                    }
                 }
-                child_jobs->len -= 1; // Decrement the number of jobs
+                break;
             }
+            case STAGE_TEE:
+                fflush(stdout); // Keep the order of the shell's own output
+                j->status = run_tee(c, in_fds[s], STDOUT_FILENO);
+                break;
+            case STAGE_EXTERNAL:
+                break;      // Already started, or skipped after a failure
+        }
+        if (in_fds[s] >= 0) {
+            close(in_fds[s]);
+        }
+        if (out_fds[s] >= 0) {
+            close(out_fds[s]);
         }
     }
+    sigaction(SIGPIPE, &old, NULL);
+
+    j->running = j->nprocs;
+    j->pid = j->nprocs ? j->pids[0] : 0;
+    flush_events(); // The spawn records of the whole pipeline go out together
+    return j->nprocs ? (ssize_t) j->nprocs : failure;
 }
 
-// Function to find a job by its PID
-struct job *find_job_by_pid(pid_t pid) {
-    if (child_jobs != NULL && child_jobs->len > 0) {
-        for (size_t i = 0, len = child_jobs->len; i < len; i++) {
-            struct job *curr_job = &child_jobs->jobs[i];
-            if (curr_job->pid == pid) {
-                return curr_job; // Return the found job
-            }
+// Function to report how a job changed state, with its resource usage if the rusage option is on
+void print_status(const struct job *j) {
+    int status = j->finished ? j->status : j->state_status; // A job still running stopped or resumed
+    if (WIFEXITED(status)) {
+        printf(">>> [%d] %s Exited %d", j->pid, j->name, WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        printf(">>> [%d] %s Killed %d", j->pid, j->name, WTERMSIG(status));
+    } else if (WIFSTOPPED(status)) {
+        printf(">>> [%d] %s Stopped %d", j->pid, j->name, WSTOPSIG(status));
+    } else if (WIFCONTINUED(status)) {
+        printf(">>> [%d] %s Continued %d", j->pid, j->name, status);
+    } else {
+        return;
+    }
+    if (options[OPT_RUSAGE].value) {
+        printf(" (");
+        print_usage(stdout, &j->usage);
+        printf(")");
+    } else if (j->usage.cgroup) {
+        printf(" (");
+        print_cgroup_usage(stdout, &j->usage); // Limited jobs always report their cgroup
+        printf(")");
+    }
+    printf("\n");
+}
+
+// Function to report the phases of a timed command line on stderr
+// j is the job that ran, NULL if a builtin ran in the shell
+void print_phases(const struct job *j) {
+    uint64_t total = now_ns() - phases.start_ns;
+    fflush(stdout); // Keep the report after the job's status line
+    fprintf(stderr, "time: parse %.1fus lookup %.1fus spawn %.1fus exec %.1fus builtin %.1fus wait %.1fus\n"
+                    "      shell %.1fus total %.1fus\n",
+            phases.parse_ns / 1e3, phases.lookup_ns / 1e3, phases.spawn_ns / 1e3, phases.exec_ns / 1e3,
+            phases.builtin_ns / 1e3, phases.wait_ns / 1e3,
+            (total - phases.wait_ns - phases.builtin_ns) / 1e3, total / 1e3); // The rest is the shell's own
+    if (j != NULL) {
+        fprintf(stderr, "      ");
+        print_usage(stderr, &j->usage);
+        fprintf(stderr, "\n");
+    }
+}
+
+// Number of child state changes the signal handler can queue, must be a power of two
+#define CHILD_RING_SIZE 256
+
+// A child state change collected by the SIGCHLD handler
+struct child_event {
+    pid_t pid;          // Process ID of the reaped child
+    int status;         // Its wait status
+    struct rusage usage; // Resources it used
+    uint64_t when;      // When it was reaped
+};
+
+// Single-producer/single-consumer ring: the SIGCHLD handler pushes, the main loop pops
+struct child_ring {
+    atomic_size_t head;                         // Next slot the handler writes
+    atomic_size_t tail;                         // Next slot the main loop reads
+    volatile sig_atomic_t overflow;             // Set when the handler left children unreaped
+    struct child_event events[CHILD_RING_SIZE]; // Queued state changes
+} child_ring;
+
+// Self-pipe written by the SIGCHLD handler so the main loop can wait on it
+int sigchld_pipe[2] = {-1, -1};
+
+// Function to reap every waitable child into the ring, async-signal-safe
+void collect_children(void) {
+    size_t head = atomic_load_explicit(&child_ring.head, memory_order_relaxed);
+    struct child_event *ev;
+    struct rusage usage;
+    int status;
+    pid_t child;
+
+    while (1) {
+        // Stop reaping when the ring is full, the main loop picks up the rest
+        if (head - atomic_load_explicit(&child_ring.tail, memory_order_acquire) >= CHILD_RING_SIZE) {
+            child_ring.overflow = 1;
+            break;
+        }
+        // wait4() also hands back what the child used, clock_gettime() is async-signal-safe
+        // Stops and resumes are queued too, the job control builtins act on them
+        if ((child = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) <= 0) {
+            break;
         }
+        ev = &child_ring.events[head & (CHILD_RING_SIZE - 1)];
+        ev->pid = child;
+        ev->status = status;
+        ev->usage = usage;
+        ev->when = now_ns();
+        head++;
+        // Publish the event only after it's fully written
+        atomic_store_explicit(&child_ring.head, head, memory_order_release);
     }
-    return NULL; // Return NULL if the job was not found
 }
 
-// Function to add a job to the list
-void add_job(const struct job *j) {
-    if (child_jobs == NULL) {
-        // Allocate initial memory for the child_jobs structure
-        child_jobs = malloc(2 * sizeof(size_t) + 4 * sizeof(struct job));
-        child_jobs->len = 0;
-        child_jobs->cap = 4;
+// Function to empty the wake-up pipe after the main loop was woken by it
+void drain_wakeup_pipe(void) {
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) { }
+}
+
+// Job the shell is currently waiting for, it isn't listed in child_jobs
+struct job *foreground_job = NULL;
+
+// Function to check whether a process belongs to a job
+int job_has_pid(const struct job *j, pid_t pid) {
+    for (size_t k = 0; k < j->nprocs; k++) {
+        if (j->pids[k] == pid) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    size_t len = child_jobs->len, cap = child_jobs->cap;
-    
-    // Expand the jobs array if necessary
-    if (len >= cap) {
-        child_jobs = realloc(child_jobs, sizeof(size_t) * 2 + sizeof(struct job) * (len + 4));
-        child_jobs->cap += 4; // Increase the capacity
+// Function to record what happened to a child on the event stream: exit, signal, stop or continue
+// Exits and deaths by a signal carry the resources the process used
+void emit_child_event(const struct child_event *ev, const struct job *j) {
+    int done = WIFEXITED(ev->status) || WIFSIGNALED(ev->status);
+    const struct rusage *ru = &ev->usage;
+    char *p;
+
+    if (events.fd < 0 || (p = begin_event(WIFEXITED(ev->status) ? "exit" : WIFSIGNALED(ev->status) ? "signal" :
+                                          WIFSTOPPED(ev->status) ? "stop" : "continue", ev->when)) == NULL) {
+        return;
     }
-    
-    struct job *new_job = &child_jobs->jobs[len]; // Pointer to the new job
-    new_job->pid = j->pid;                        // Set the new job's PID
-    new_job->name = strdup(j->name);              // Copy the job's name (dynamically allocated)
+    p += sprintf(p, ",\"pid\":%d,\"job\":%d", ev->pid, j != NULL ? j->pid : 0);
+    if (WIFEXITED(ev->status)) {
+        p += sprintf(p, ",\"status\":%d", WEXITSTATUS(ev->status));
+    } else if (WIFSIGNALED(ev->status)) {
+        p += sprintf(p, ",\"signal\":%d,\"core\":%s", WTERMSIG(ev->status), WCOREDUMP(ev->status) ? "true" : "false");
+    } else if (WIFSTOPPED(ev->status)) {
+        p += sprintf(p, ",\"signal\":%d", WSTOPSIG(ev->status));
+    }
+    if (done) {
+        p += sprintf(p, ",\"utime_us\":%" PRId64 ",\"stime_us\":%" PRId64 ",\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld"
+                     ",\"nvcsw\":%ld,\"nivcsw\":%ld",
+                     (int64_t) ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec,
+                     (int64_t) ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec,
+                     ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+    }
+    end_event(p);
+}
 
-    child_jobs->len += 1; // Increment the number of jobs
+// Function to apply a child's state change to the job it belongs to
+void route_child_event(const struct child_event *ev) {
+    struct job_slot *slot = NULL;
+    struct job *j = NULL;
+
+    if (foreground_job != NULL && job_has_pid(foreground_job, ev->pid)) {
+        j = foreground_job; // The job the shell waits for
+    } else if ((slot = find_job_slot(ev->pid)) != NULL) {
+        j = &child_jobs->jobs[slot->job - 1];
+    }
+    emit_child_event(ev, j);
+    stat_counters.children++;
+    if (j == NULL) {
+        return;
+    } else if (WIFSTOPPED(ev->status) || WIFCONTINUED(ev->status)) {
+        job_process_stopped(j, ev->pid, ev->status); // Still a child of the shell
+    } else {
+        if (slot != NULL) {
+            remove_job_slot(slot); // The PID may be reused from now on
+        }
+        job_process_exited(j, ev->pid, ev->status, &ev->usage, ev->when);
+        if (j->finished && j->cgroup != NULL) {
+            release_job_cgroup(j); // Empty now, read what it used before it goes
+        }
+    }
 }
 
-// Function to free all jobs, releasing memory resources
-void free_jobs(void) {
-    if (child_jobs != NULL && child_jobs->len > 0) {
-        for (size_t i = 0, len = child_jobs->len; i < len; i++) {
-            struct job *curr_job = &child_jobs->jobs[i];
-            free(curr_job->name); // Free each job's name memory
+// Function to turn the siginfo of a waitid() into a wait status like waitpid() returns
+int siginfo_status(const siginfo_t *info) {
+    switch (info->si_code) {
+        case CLD_EXITED:
+            return W_EXITCODE(info->si_status, 0);
+        case CLD_KILLED:
+            return info->si_status;
+        case CLD_DUMPED:
+            return info->si_status | WCOREFLAG;
+        case CLD_STOPPED:
+        case CLD_TRAPPED:
+            return W_STOPCODE(info->si_status);
+        default:
+            return 0xffff; // CLD_CONTINUED, what WIFCONTINUED() tests for
+    }
+}
+
+// Function to collect child state changes in pidfd mode and apply them to their jobs
+// Exits are read from the pidfds epoll reports ready; stops and resumes, which pidfds don't
+// signal, are picked up with a waitid() scan after a SIGCHLD
+void collect_pidfd_events(void) {
+    struct epoll_event ready[64];
+    struct child_event ev;
+    siginfo_t info;
+    int n;
+
+    if (child_signalled) {
+        child_signalled = 0;
+        while (1) {
+            info.si_pid = 0;
+            if (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) < 0 || info.si_pid == 0) {
+                break;
+            }
+            ev.pid = info.si_pid;
+            ev.status = siginfo_status(&info);
+            ev.when = now_ns();
+            route_child_event(&ev);
+        }
+        for (size_t i = 0; i < untracked.len; ) {
+            if (wait4(untracked.pids[i], &ev.status, WNOHANG, &ev.usage) == untracked.pids[i]) {
+                ev.pid = untracked.pids[i];
+                ev.when = now_ns();
+                untracked.pids[i] = untracked.pids[--untracked.len];
+                route_child_event(&ev);
+            } else {
+                i++;
+            }
         }
     }
-    free(child_jobs); // Free the entire job list structure
-    child_jobs = NULL; // Set the global pointer to NULL for safety
+    do {
+        n = epoll_wait(child_epoll, ready, 64, 0);
+        for (int i = 0; i < n; i++) {
+            int fd = ready[i].data.u64 >> 32;
+            pid_t reaped;
+            info.si_pid = 0;
+            ev.pid = (pid_t) (uint32_t) ready[i].data.u64;
+            // The system call, unlike the libc wrapper, also hands back what the child used
+            if (syscall(SYS_waitid, P_PIDFD, fd, &info, WEXITED | WNOHANG, &ev.usage) == 0) {
+                reaped = info.si_pid;
+                ev.status = siginfo_status(&info);
+            } else {
+                // A kernel without P_PIDFD (Linux 5.3) or a failed call: reap by PID, the child is ours
+                // until it is waited for, so the PID still names it
+                while ((reaped = wait4(ev.pid, &ev.status, WNOHANG, &ev.usage)) < 0 && errno == EINTR) { }
+            }
+            if (reaped == 0) {
+                continue; // Not reapable yet, the pidfd stays registered
+            }
+            ev.when = now_ns();
+            // Children being launched may still hold a copy of the pidfd, and epoll only forgets a
+            // descriptor by itself once every copy is closed
+            epoll_ctl(child_epoll, EPOLL_CTL_DEL, fd, NULL);
+            close(fd);
+            child_pidfds--;
+            if (reaped == ev.pid) {
+                route_child_event(&ev);
+            }
+        }
+    } while (n == 64);
 }
 
-// Structure to store command details
-struct command {
-    char *cmd;    // Command name
-    char *argv[]; // Argument vector, including command as first argument
-};
+// Function to move queued child events into the job list at a safe point
+void drain_child_events(void) {
+    size_t tail = atomic_load_explicit(&child_ring.tail, memory_order_relaxed);
+    uint64_t start = now_ns(), routed = stat_counters.children;
 
-// Enumeration to identify the type of command parsed
-enum command_type {
-    FAIL,        // Parsing failed
-    SPACES,      // Command contains only spaces
-    FOREGROUND,  // Foreground execution command
-    BACKGROUND   // Background execution command
-};
+    if (child_epoll >= 0) {
+        collect_pidfd_events();
+    }
+    while (child_epoll < 0) {
+        size_t head = atomic_load_explicit(&child_ring.head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            route_child_event(&child_ring.events[tail & (CHILD_RING_SIZE - 1)]);
+        }
+        // Hand the slots back to the handler
+        atomic_store_explicit(&child_ring.tail, tail, memory_order_release);
 
-// Function to generate a command structure based on the user input
-enum command_type gen_command(char *line, ssize_t len, struct command **c) {
-    // Variables for parsing logic
-    int i = 0, start = 0;
-    size_t num_args = 0;
-    int is_background = 0;
-
-    // Parsing input to identify command type and arguments
-    for (i = 0; i < len; ++i) {
-        // Fail on non-printable/non-space characters
-        if (!isprint(line[i]) && !isspace(line[i])) {
-            return FAIL;
+        if (!child_ring.overflow) {
+            break;
+        }
+        // The handler gave up on a full ring, finish its work with SIGCHLD held off
+        sigset_t block, old;
+        sigemptyset(&block);
+        sigaddset(&block, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &block, &old);
+        child_ring.overflow = 0;
+        collect_children();
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+    if (stat_counters.children != routed) {
+        record_time(STAT_REAP, now_ns() - start); // Calls that found nothing aren't counted
+    }
+    flush_events(); // Everything reaped in one go is written in one go
+}
+
+// Function to report finished background jobs and remove them from the job list
+// Jobs that stopped or resumed are reported and stay listed
+// Returns the number of jobs that were reported
+int report_finished_jobs(void) {
+    int reported = 0;
+    size_t i = 0;
+    while (child_jobs != NULL && i < child_jobs->len) {
+        struct job *j = &child_jobs->jobs[i];
+        if (j->finished) {
+            print_status(j); // Report the status of the background job
+            free_job(i); // Moves another job into slot i
+            reported++;
+        } else {
+            if (j->notify) {
+                print_status(j);
+                j->notify = 0;
+                reported++;
+            }
+            i++;
+        }
+    }
+    return reported;
+}
+
+// Function to check for completed background processes and remove them from the job list
+// Returns the number of jobs that were reported
+int reap_background_jobs(void) {
+    drain_child_events();
+    if (job_cgroups.num_lingering > 0) {
+        retry_job_cgroups(); // Processes left behind by finished jobs may have gone since
+    }
+    return report_finished_jobs();
+}
+
+// Function to wait until every process of the foreground job has been reaped by the SIGCHLD handler,
+// or until all of them are stopped; a stopped job's status is 128 plus the stop signal
+int wait_for_foreground(struct job *j) {
+    struct pollfd fds[2] = {
+        { .fd = sigchld_pipe[0], .events = POLLIN },
+        { .fd = child_epoll,     .events = POLLIN }, // Ignored by poll() without pidfds
+    };
+
+    foreground_job = j;
+    while (1) {
+        drain_wakeup_pipe(); // Empty it first so no wake-up after the check is lost
+        drain_child_events();
+        if (j->finished || job_is_stopped(j)) {
+            break;
         }
-        // Detect background execution symbol '&'
-        if (line[i] == '&') {
-            is_background = 1;
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            perror("poll");
             break;
-        } else if ((isspace(line[i + 1]) || line[i + 1] == '\0') && !isspace(line[i])) {
-            num_args++; // Counting arguments based on spaces
         }
     }
+    foreground_job = NULL;
+    return j->finished ? j->status : W_EXITCODE(128 + WSTOPSIG(j->state_status), 0);
+}
 
-    if (num_args == 0) {
-        return SPACES; // No arguments, only spaces
+// Function to wait until n more children can get a pidfd without exceeding the descriptor budget
+// Their exits are recorded meanwhile and reported later like any other
+void reserve_pidfds(size_t n) {
+    struct pollfd fds[2] = {
+        { .fd = sigchld_pipe[0], .events = POLLIN },
+        { .fd = child_epoll,     .events = POLLIN },
+    };
+    while (child_epoll >= 0 && child_pidfds > 0 && child_pidfds + n > pidfd_budget) {
+        drain_wakeup_pipe();
+        drain_child_events();
+        if (child_pidfds + n <= pidfd_budget) {
+            break;
+        }
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
     }
+}
 
-    // Allocate memory for command structure based on argument count
-    *c = malloc(sizeof(struct command) + sizeof(char *) * (num_args + 2));
+// Function to give a job the terminal and wait for it to finish or stop, continuing it first if cont is set
+// A stopped job goes back to the job list; returns the status from wait_for_foreground()
+int run_in_foreground(struct job *j, int cont) {
+    int status, tty = shell_terminal >= 0 && j->pgid > 0;
 
-    // Extracting arguments and setting them in the command structure
-    size_t count = 0;
-    for (i = 0; i < len; ++i) {
-        if (isspace(line[i]) && !isspace(line[i + 1])) {
-            start = i + 1; // Start of a new argument
-        } else if (!isspace(line[i]) && (isspace(line[i + 1]) || line[i + 1] == '\0')) {
-            if (count == 0) {
-                // Setting command name for the first argument
-                (*c)->cmd = strndup(&line[start], i - start + 1);
-            }
-            // Storing arguments in the array
-            (*c)->argv[count] = strndup(&line[start], i - start + 1);
-            count++;
+    if (tty) {
+        tcsetpgrp(shell_terminal, j->pgid); // The job may have taken it already, see spawn_command()
+    }
+    if (cont && !j->finished) {
+        signal_job(j, SIGCONT);
+    }
+    status = wait_for_foreground(j);
+    if (tty) {
+        tcsetpgrp(shell_terminal, shell_pgid);
+        // A stopped or killed program had no chance to restore the terminal modes
+        if (!j->finished || WIFSIGNALED(j->status)) {
+            tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
         }
     }
-    (*c)->argv[num_args] = NULL; // Null-terminate the argument vector
+    print_status(j);
+    if (!j->finished) {
+        j->notify = 0; // Reported just now
+        add_job(j);
+    }
+    return status;
+}
 
-    return is_background ? BACKGROUND : FOREGROUND; // Return command type
+// Signal handler for SIGCHLD: reaps children into the ring and wakes up the main loop
+void sigchld_handler(int sig) {
+    int saved_errno = errno; // waitpid() and write() may clobber errno of the interrupted code
+    char byte = 0;
+    (void) sig;
+    if (child_epoll >= 0) {
+        child_signalled = 1; // Exits arrive on the pidfds, stops are looked up in the main loop
+    } else {
+        collect_children();
+    }
+    // The pipe is non-blocking, so the only other failure is EAGAIN: a full pipe means a wake-up is pending
+    while (write(sigchld_pipe[1], &byte, 1) < 0 && errno == EINTR) { }
+    errno = saved_errno;
 }
 
-// Function to free memory allocated for a command structure
-void free_command(struct command *c) {
-    if (c) {
-        free(c->cmd); // Free the command name
-        for (int i = 0; c->argv[i]; i++) {
-            free(c->argv[i]); // Free each argument string
+// Function to install the SIGCHLD handler and its wake-up pipe
+int init_child_events(void) {
+    struct sigaction sa;
+    if (pipe(sigchld_pipe) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    // Neither end may block the shell, and children must not inherit them
+    for (int i = 0; i < 2; i++) {
+        fcntl(sigchld_pipe[i], F_SETFL, fcntl(sigchld_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+#ifdef SYS_pidfd_open
+    // Watch children through pidfds if the kernel can also wait on them (Linux 5.4)
+    siginfo_t info;
+    int probe = syscall(SYS_pidfd_open, getpid(), 0);
+    if (probe >= 0) {
+        if (waitid(P_PIDFD, probe, &info, WEXITED | WNOHANG) < 0 && errno == ECHILD) {
+            struct rlimit rl;
+            child_epoll = epoll_create1(EPOLL_CLOEXEC);
+            // Leave room below the descriptor limit for pipes and redirections
+            pidfd_budget = SIZE_MAX;
+            if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+                pidfd_budget = rl.rlim_cur > 128 ? rl.rlim_cur - 64 : rl.rlim_cur / 2;
+            }
         }
-        free(c); // Free the command structure itself
+        close(probe);
+    }
+#endif
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART; // Don't disturb blocking calls in the loop, stopped children wake it too
+    if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+        perror("sigaction");
+        return -1;
     }
+    return 0;
 }
 
-// Enumeration for built-in shell commands
-enum built_ins {
-    EXIT,     // Exit command
-    PID,      // Print the current process ID
-    PPID,     // Print the parent process ID
-    CD,       // Change directory command
-    PWD,      // Print working directory command
-    JOBS,     // List background jobs
-    NOT       // No built-in command executed
-};
+// Function to give a copy of the shell made by fork() its own child events
+// The ring and wake-up pipe still belong to the parent's children
+int reset_child_events(void) {
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    if (child_epoll >= 0) {
+        close(child_epoll); // The inherited pidfds stay open but aren't watched
+        child_epoll = -1;
+    }
+    child_pidfds = 0;
+    untracked.len = 0;
+    child_signalled = 0;
+    atomic_store(&child_ring.head, 0);
+    atomic_store(&child_ring.tail, 0);
+    child_ring.overflow = 0;
+    return init_child_events();
+}
 
-// Function to execute built-in shell commands or identify if a command is not built-in
-enum built_ins run_built_in(const struct command *c) {
-    // If command is "exit", signal to exit the shell
-    if (!strcmp(c->cmd, "exit")) {
-        return EXIT;
+// Function to put the shell in the foreground process group of its terminal so it can hand
+// the terminal to jobs; without a controlling terminal jobs still get their own groups
+void init_job_control(int fd) {
+    pid_t fg;
+
+    // Started in the background: stop until the user brings the shell to the foreground
+    while ((fg = tcgetpgrp(fd)) >= 0 && fg != getpgrp()) {
+        kill(-getpgrp(), SIGTTIN);
+    }
+    if (fg < 0) {
+        return;
+    }
+    // Ctrl-C, Ctrl-Z and terminal access from the background are meant for jobs, not the shell
+    for (size_t i = 0; i < NUM_JOB_CONTROL_SIGNALS; i++) {
+        signal(job_control_signals[i], SIG_IGN);
     }
+    // A session leader already leads its group and can't move to another one
+    if (getpgrp() != getpid() && setpgid(0, 0) < 0) {
+        perror("setpgid");
+        default_job_signals();
+        return;
+    }
+    shell_pgid = getpid();
+    tcsetpgrp(fd, shell_pgid);
+    tcgetattr(fd, &shell_tmodes);
+    shell_terminal = fd;
+}
+
+// Function to check whether stdio already holds unread input for stdin
+int stdin_has_buffered_input(void) {
+#ifdef __GLIBC__
+    return stdin->_IO_read_ptr < stdin->_IO_read_end;
+#else
+    return 0; // stdin is left unbuffered on other C libraries, see main()
+#endif
+}
 
-    // If command is "pid", print the shell's process ID
-    if (!strcmp(c->cmd, "pid")) {
-        printf("Shell pid: %d\n", getpid());
-        return PID;
+// Function to block until a command line can be read, reporting background jobs
+// that finish in the meantime and re-displaying the prompt after them
+void wait_for_input(const char *prompt) {
+    struct pollfd fds[3] = {
+        { .fd = STDIN_FILENO,    .events = POLLIN },
+        { .fd = sigchld_pipe[0], .events = POLLIN },
+        { .fd = child_epoll,     .events = POLLIN }, // A child exited, without pidfds it is -1
+    };
+    while (!stdin_has_buffered_input()) {
+        fflush(stdout); // The prompt has no newline, push it out before sleeping
+        flush_events();
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue; // Woken up by a signal, the pipe tells us why
+            }
+            perror("poll");
+            return;
+        }
+        // A child changed state: reap it now instead of on the next command
+        if ((fds[1].revents | fds[2].revents) & POLLIN) {
+            drain_wakeup_pipe();
+            if (reap_background_jobs() > 0) {
+                printf("%s", prompt); // Job reports overwrote the prompt line
+            }
+        }
+        // Data, EOF or an error on stdin all mean getline() won't block
+        if (fds[0].revents) {
+            return;
+        }
     }
+}
 
-    // If command is "ppid", print the shell's parent process ID
-    if (!strcmp(c->cmd, "ppid")) {
-        printf("Shell's Parent pid: %d\n", getppid());
-        return PPID;
+// Function to wait until fewer than limit background jobs are left, reporting the ones that finish
+// Gives up at deadline (CLOCK_MONOTONIC nanoseconds) unless it is 0
+// Returns 0, or -1 if jobs were still left at the deadline
+int wait_for_jobs(size_t limit, uint64_t deadline) {
+    struct pollfd fds[2] = {
+        { .fd = sigchld_pipe[0], .events = POLLIN },
+        { .fd = child_epoll,     .events = POLLIN },
+    };
+    int timeout = -1;
+
+    while (1) {
+        drain_wakeup_pipe(); // Empty it first so no wake-up after the check is lost
+        reap_background_jobs();
+        if (child_jobs == NULL || child_jobs->len < limit) {
+            return 0;
+        }
+        if (deadline != 0) {
+            uint64_t now = now_ns();
+            if (now >= deadline) {
+                return -1;
+            }
+            timeout = (deadline - now + 999999) / 1000000; // Round up so the deadline is reached
+        }
+        fflush(stdout); // Show the reports while waiting
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
     }
+}
 
-    // If command is "cd", change the current directory
-    if(!strcmp(c->cmd, "cd") && !strcmp(c->argv[0], "cd")) {
-        int fail = 0;
-        // If an argument is provided, attempt to change to that directory; otherwise, change to HOME
-        if(c->argv[1] != NULL) {
-            fail = chdir(c->argv[1]);
-        } 
-        else {
-            fail = chdir(getenv("HOME"));
+// Function to send a signal to every process of the background jobs that hasn't been reaped
+void signal_jobs(int sig) {
+    for (size_t i = 0; child_jobs != NULL && i < child_jobs->len; i++) {
+        if (!child_jobs->jobs[i].finished) {
+            signal_job(&child_jobs->jobs[i], sig);
         }
-        // If changing directory fails, print an error message
-        if (fail) {
-            perror("cd");
+    }
+}
+
+// How long jobs get to react to SIGTERM at shutdown before they are killed
+#define SHUTDOWN_GRACE_NS 1000000000ull
+
+// Function to deal with the background jobs still running when the shell ends
+// They get timeout seconds to finish and are then sent SIGTERM, and SIGKILL if that
+// doesn't end them either; a negative timeout leaves them running, as before
+void shutdown_jobs(double timeout) {
+    if (child_jobs == NULL || timeout < 0) {
+        return;
+    }
+    if (wait_for_jobs(1, now_ns() + (uint64_t) (timeout * 1e9)) == 0) {
+        return;
+    }
+    signal_jobs(SIGTERM);
+    if (wait_for_jobs(1, now_ns() + SHUTDOWN_GRACE_NS) == 0) {
+        return;
+    }
+    signal_jobs(SIGKILL);
+    wait_for_jobs(1, now_ns() + SHUTDOWN_GRACE_NS);
+}
+
+// Function to run one pipeline of a command line, in the shell if it is a single builtin
+// status receives its wait status, a background job counts as successful
+// Returns the builtin that ran, NOT if the pipeline ran as a job
+enum built_ins run_pipeline(struct pipeline *c, int *status, int *error) {
+    uint64_t start = now_ns();
+    enum built_ins ret;
+    struct job j;
+
+    // A time prefix times the parse of the line and this pipeline
+    phases = (struct phase_times) { .start_ns = start - phases.parse_ns, .parse_ns = phases.parse_ns };
+    *status = 0;
+    // References and wildcards see what earlier commands of the line did
+    switch (expand_pipeline(c)) {
+        case 1:
+            return NOT; // Only assignments
+        case -1:
+            *status = W_EXITCODE(1, 0);
+            return NOT;
+    }
+
+    // Execute built-in commands, if any, a pipeline runs stages as external commands
+    ret = c->len == 1 ? run_redirected_built_in(&c->stages[0], stdout) : NOT;
+    if (ret != NOT) {
+        phases.builtin_ns = now_ns() - start;
+        *status = W_EXITCODE(ret == REDIRECT ? 1 : built_in_status, 0);
+        if (c->timed) {
+            print_phases(NULL);
         }
-        return CD;
+        return ret;
     }
 
-    // If command is "pwd", print the current working directory
-    if (!strcmp(c->cmd, "pwd")) {
-        char cwd[MAXPATHLEN];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            printf("%s\n", cwd);
-        } else {
-            perror("cd");
+    // Create child processes for the stages of non-built-in commands
+    reserve_pidfds(c->len);
+    switch (launch_pipeline(c, c->background, &j)) {
+        case -1:
+            *error = -3;  // Handle fork failure
+            *status = W_EXITCODE(1, 0);
+            return NOT;
+        case 0:
+            *status = j.status;  // None of the commands could be executed
+            return NOT;
+    }
+    if (!c->background) {  // Parent process: foreground execution
+        // Wait for every process of the pipeline to complete, and report the exit status
+        uint64_t wait_start = now_ns();
+        *status = run_in_foreground(&j, 0);
+        phases.wait_ns = now_ns() - wait_start;
+        record_time(STAT_WAIT, phases.wait_ns);
+    } else {  // Parent process: background execution
+        // Add the background job to the job list
+        add_job(&j);
+    }
+    if (c->timed) {
+        print_phases(!c->background ? &j : NULL); // A background job is timed up to its launch
+    }
+    return NOT;
+}
+
+enum built_ins run_list(struct pipeline *p, int *status, int *error);
+
+// Function to run the pipelines from first to last as one background job in a copy of the shell
+void run_subshell(struct pipeline *first, struct pipeline *last, int *error) {
+    size_t name_len = 1;
+    int monitor = options[OPT_MONITOR].value;
+    unsigned char stopped = 0;
+    struct pipeline *q;
+    struct job j;
+    char *name;
+    pid_t pid;
+
+    // The job is named after the list's commands and operators
+    for (q = first; q != last->next; q = q->next) {
+        for (size_t s = 0; s < q->len; s++) {
+            name_len += strlen(q->stages[s].cmd) + 4;
+        }
+    }
+    name = arena_alloc(&command_arena, name_len);
+    name[0] = '\0';
+    for (q = first, j.name = name; q != last->next; q = q->next) {
+        for (size_t s = 0; s < q->len; s++) {
+            name += sprintf(name, s ? " | %s" : "%s", q->stages[s].cmd);
+        }
+        if (q != last) {
+            name += sprintf(name, q->op == LIST_AND ? " && " : q->op == LIST_OR ? " || " : "; ");
         }
-        return PWD;
     }
 
-    // If command is "jobs", list all background jobs
-    if(!strcmp(c->cmd, "jobs")) {
-        size_t i, len = child_jobs->len;
-        for(i = 0; i < len; i++){
-            struct job *curr = &child_jobs->jobs[i];
-            printf("[%d] %s\n", curr->pid, curr->name);
+    reserve_pidfds(1);
+    fflush(stdout); // The copy must not inherit and later flush buffered output
+    if ((pid = fork()) < 0) {
+        perror("Fork Failed");
+        *error = -3;
+        return;
+    } else if (pid == 0) {  // Child process: runs the list in the foreground and exits with its status
+        int status = 0;
+        last->next = NULL;
+        for (q = first; q != NULL; q = q->next) {
+            q->background = 0;
+        }
+        free_jobs(); // The shell's other jobs aren't this process's children
+        detach_events();
+        if (reset_child_events() < 0) {
+            _exit(127);
+        }
+        // The whole list is one job: its commands stay in this process's group, off the terminal
+        if (monitor) {
+            setpgid(0, 0);
         }
-        return JOBS;
+        if (shell_terminal >= 0) {
+            default_job_signals();
+        }
+        shell_terminal = -1;
+        options[OPT_MONITOR].value = 0;
+        run_list(first, &status, error);
+        fflush(stdout);
+        finish_events();
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+    track_child(pid);
+    if (monitor) {
+        setpgid(pid, pid); // Whichever of parent and child runs first creates the group
     }
+    printf(">>> [%d] %s\n", pid, j.name);
+    j.id = 0;
+    j.pid = j.status_pid = pid;
+    j.pgid = monitor ? pid : 0;
+    j.pids = &pid;
+    j.stopped = &stopped;
+    j.nstopped = 0;
+    j.nprocs = j.running = 1;
+    j.status = j.state_status = 0;
+    j.finished = j.notify = 0;
+    j.cgroup = NULL;
+    memset(&j.usage, 0, sizeof(j.usage));
+    j.usage.start_ns = now_ns();
+    emit_spawn_event(pid, &j, j.name);
+    flush_events();
+    add_job(&j);
+}
+
+// Function to run the pipelines of a command line in order, skipping the ones ruled out by && and ||
+// An and-or list ended by '&' with more than one pipeline runs as one job in a copy of the shell
+// status receives the status of the last pipeline that ran
+// Returns EXIT if the exit builtin ran, NOT otherwise
+enum built_ins run_list(struct pipeline *p, int *status, int *error) {
+    enum list_op prev = LIST_SEQ;
 
-    // If none of the above commands match, return NOT to indicate it's not a built-in command
+    *status = 0;
+    while (p != NULL) {
+        struct pipeline *last = p;
+        while (p->background && (last->op == LIST_AND || last->op == LIST_OR)) {
+            last = last->next;
+        }
+        if (last != p) {
+            run_subshell(p, last, error); // A background list always follows ';' or starts the line
+            *status = 0;
+        } else if (prev == LIST_SEQ || (prev == LIST_AND) == (*status == 0)) {
+            enum built_ins ret = run_pipeline(p, status, error);
+            last_status = WIFEXITED(*status) ? WEXITSTATUS(*status) : 128 + WTERMSIG(*status);
+            if (ret == EXIT) {
+                return EXIT;
+            }
+            phases.parse_ns = 0; // Only the first pipeline includes parsing the line
+        }
+        prev = last->op;
+        p = last->next;
+    }
     return NOT;
 }
 
+// Function to run every command line of a file with at most max_jobs of them running at once
+// Each line is started as a background job as soon as a slot is free, and is reported
+// like one when it finishes; builtins run in the shell in between
+// Returns 0, or an error code if the file couldn't be read or a line couldn't be run
+int run_batch(const char *file, size_t max_jobs) {
+    FILE *in = strcmp(file, "-") ? fopen(file, "r") : stdin;
+    struct pipeline *c = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int error = 0;
+    struct job j;
+
+    if (in == NULL) {
+        perror(file);
+        return -1;
+    }
+    while ((len = getline(&line, &cap, in)) > 0) {
+        uint64_t parse_start = now_ns();
+        enum command_type type = gen_pipeline(line, len, &c);
+        record_time(STAT_PARSE, now_ns() - parse_start);
+        stat_counters.lines++;
+        if (type == FAIL) {
+            fprintf(stderr, "Could not parse command from line\n");
+            error = -2;
+            continue;
+        }
+        if (type == SPACES) {
+            continue;
+        }
+        // A list is expanded command by command in its copy of the shell
+        int expanded = c->next == NULL ? expand_pipeline(c) : 0;
+        // Builtins change the shell itself, so they run in order between the launches
+        enum built_ins ret = expanded == 0 && c->len == 1 && c->next == NULL ? run_redirected_built_in(&c->stages[0], stdout) : NOT;
+        if (expanded != 0) {
+            error = expanded < 0 ? -2 : error; // Assignments are made in the shell too
+        } else if (ret == NOT && c->next != NULL) {
+            struct pipeline *last = c;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            wait_for_jobs(max_jobs, 0); // A list runs as one job in a copy of the shell
+            run_subshell(c, last, &error);
+        } else if (ret == NOT) {
+            wait_for_jobs(max_jobs, 0); // Take a free slot
+            reserve_pidfds(c->len);
+            if (launch_pipeline(c, 1, &j) > 0) {
+                add_job(&j);
+            } else {
+                error = -3;
+            }
+        }
+        reset_command_arena();
+        c = NULL;
+        if (ret == EXIT) {
+            break; // Jobs already started still run to completion
+        }
+        reap_background_jobs();
+    }
+    wait_for_jobs(1, 0); // Wait for every job
+    if (in != stdin) {
+        fclose(in);
+    }
+    free(line);
+    return error;
+}
+
+// Largest input line buffer kept alive between commands
+#define LINE_KEEP_MAX (1 << 16)
+// stdio buffer size for scripts and their output
+#define SCRIPT_BUFFER_SIZE (1 << 16)
+
 // Main function: the entry point of the shell program
 int main(int argc, char *argv[]) {
-    struct command *c = NULL;  // Pointer to store the command structure
+    struct pipeline *c = NULL; // Pointer to store the pipeline structure
     char *line = NULL,         // Buffer for the input line
          *prompt = "308sh> ";  // Default prompt string
     size_t thats_cap = 0;      // Capacity for getline function
     ssize_t len;               // Length of the input line
     int error = 0;             // Error flag
-    int status;                // Status of the child process
-    pid_t pid;                 // Process ID
     enum command_type type = FAIL;  // Type of the command
+    int status;                // Status of the last pipeline that ran
+    const char *batch_file = NULL;  // File of commands to run as a script or batch
+    char *command = NULL;      // Command line given with -c
+    long max_jobs = 0;         // Most batch commands running at once, 0 to run a script
+    double shutdown_timeout = -1;  // Seconds background jobs get when the shell ends, negative to leave them
+    const char *event_dest = NULL; // Descriptor or Unix socket job events are written to
+    int opt, usage = 0;
+    FILE *in = stdin;          // Where command lines are read from
+    int interactive;           // Set when the user types at a terminal: show prompts and poll
+
+    // Parse the command-line options: a custom prompt, a script or command, or a batch of commands to run
+    while ((opt = getopt(argc, argv, "p:j:f:c:t:e:")) != -1) {
+        switch (opt) {
+            case 'p':
+                prompt = optarg;  // Set the custom prompt
+                break;
+            case 'j':
+                max_jobs = strtol(optarg, NULL, 10);
+                usage |= max_jobs < 1;
+                break;
+            case 'f':
+                batch_file = optarg;
+                break;
+            case 'c':
+                command = optarg;
+                break;
+            case 't':
+                shutdown_timeout = strtod(optarg, NULL);
+                usage |= shutdown_timeout < 0;
+                break;
+            case 'e':
+                event_dest = optarg;
+                break;
+            default:
+                usage = 1;
+                break;
+        }
+    }
+    if (usage || optind != argc || (max_jobs > 0 && batch_file == NULL) || (command != NULL && batch_file != NULL)) {
+        printf("Incorrect usage: \n./shell [-p prompt] [-t timeout] [-e fd|socket] [-f script | -c command | -j jobs -f file]\n");
+        goto Exit;
+    }
+
+    // A script or command replaces stdin as the source of command lines
+    if (command != NULL) {
+        in = fmemopen(command, strlen(command), "r");
+    } else if (batch_file != NULL && max_jobs == 0) {
+        in = strcmp(batch_file, "-") ? fopen(batch_file, "r") : stdin;
+    }
+    if (in == NULL) {
+        perror(command != NULL ? "-c" : batch_file);
+        error = -1;
+        goto Exit;
+    }
+    interactive = in == stdin && isatty(STDIN_FILENO);
+
+    // Use vector instructions for tokenizing if the CPU has them
+    init_scanner();
+    init_variables();
+    if (event_dest != NULL && init_events(event_dest) < 0) {
+        error = -1;
+        goto Exit;
+    }
+
+    if (!interactive) {
+        // Scripts are read in large blocks and nobody watches the output line by line
+        setvbuf(in, NULL, _IOFBF, SCRIPT_BUFFER_SIZE);
+        if (!isatty(STDOUT_FILENO)) {
+            setvbuf(stdout, NULL, _IOFBF, SCRIPT_BUFFER_SIZE);
+        }
+    } else {
+#ifndef __GLIBC__
+        // Without access to the stdio read buffer, keep it empty so poll() sees all input
+        setvbuf(stdin, NULL, _IONBF, 0);
+#endif
+    }
+
+    // Children start with the shell's signal mask, before job control ignores any signals
+    sigprocmask(SIG_SETMASK, NULL, &shell_sigmask);
+    // An interactive shell runs each job in its own process group and switches the terminal between them
+    if (interactive) {
+        options[OPT_MONITOR].value = 1;
+        init_job_control(STDIN_FILENO);
+        init_history();  // Only what users type is worth recalling
+    }
+
+    // Wake the main loop whenever a child process changes state
+    if (init_child_events() < 0) {
+        error = -5;
+        goto Exit;
+    }
 
-    // Validate command-line arguments for setting a custom prompt
-    if (argc != 1 && argc != 3) {
-        printf("Incorrect usage: \n./shell [-p prompt]\n");
+    // Batch mode runs the file's commands and exits instead of reading from the user
+    if (max_jobs > 0) {
+        error = run_batch(batch_file, max_jobs);
         goto Exit;
-    } else if (argc == 3 && !strcmp(argv[1], "-p")) {
-        prompt = argv[2];  // Set the custom prompt
     }
 
     // Main loop of the shell
     while (1) {
-        usleep(1000);  // Delay for stability
-        printf("%s", prompt);  // Display the prompt
-        // Read the command line
-        if ((len = getline(&line, &thats_cap, stdin)) <= 0) {
-            fprintf(stderr, "Failed to read command line\n");
-            error = -1;
-            continue;  // Continue to the next iteration on error
+        if (interactive) {
+            printf("%s", prompt);  // Display the prompt
+            wait_for_input(prompt);  // Sleep until input arrives, reporting finished jobs
+        }
+        // Read the command line, a script just blocks here
+        if ((len = getline(&line, &thats_cap, in)) <= 0) {
+            // Nothing more will arrive either way, so end the shell instead of retrying
+            if (ferror(in)) {
+                fprintf(stderr, "Failed to read command line\n");
+                error = -1;
+            } else if (interactive) {
+                printf("\n");  // End the prompt's line on Ctrl-D
+            }
+            break;
+        }
+        // Keep what the user typed, before parsing splits the line up
+        if (interactive) {
+            add_history(line, len);
         }
+        memset(&phases, 0, sizeof(phases));  // Timestamps for a time prefix start here
+        phases.start_ns = now_ns();
         
-        // Parse the input line into a command structure
-        if ((type = gen_command(line, len, &c)) == FAIL) {
+        // Parse the input line into a pipeline structure
+        type = gen_pipeline(line, len, &c);
+        phases.parse_ns = now_ns() - phases.start_ns;
+        record_time(STAT_PARSE, phases.parse_ns);
+        stat_counters.lines++;
+        if (type == FAIL) {
             fprintf(stderr, "Could not parse command from line\n");
             error = -2;
             goto FreeLine;  // Free resources if parsing fails
@@ -275,74 +4982,25 @@ int main(int argc, char *argv[]) {
             goto FreeLine;
         }
         
-        // Execute built-in commands, if any
-        switch (run_built_in(c)) {
-            default:
-                goto FreeCommand;  // Free resources for non-built-in commands
-            case EXIT:
-                goto ExitCommand;  // Exit the shell for the EXIT command
-            case NOT:
-               break;  // Continue to process non-built-in commands
+        // Run the line's pipelines in order, builtins in the shell and the rest as jobs
+        if (run_list(c, &status, &error) == EXIT) {
+            goto ExitCommand;  // Exit the shell for the EXIT command
         }
 
-        // Create a child process for non-built-in commands
-        if ((pid = fork()) < 0) {
-            perror("Fork Failed");
-            error = -3;
-            goto FreeCommand;  // Handle fork failure
-        } else if (pid == 0) {  // Child process
-            // Execute the command
-            printf(">>> [%d] %s\n", getpid(), c->cmd);
-            execvp(c->cmd, c->argv);
-            perror("Command Not Found");
-            error = -4;
-            goto ExitCommand;
-        } else if (type == FOREGROUND) {  // Parent process: foreground execution
-            // Wait for the child process to complete
-            waitpid(pid, &status, 0);
-            // Report the exit status
-            if(WIFEXITED(status)){
-                printf(">>> [%d] %s Exited %d\n", pid, c->cmd, WEXITSTATUS(status));
-            } else if (WIFSIGNALED(status)){
-                printf(">>> [%d] %s Killed %d\n", pid, c->cmd, WTERMSIG(status));
-            } else if (WIFSTOPPED(status)){
-                printf(">>> [%d] %s Stopped %d\n", pid, c->cmd, WSTOPSIG(status));
-            } else if (WIFCONTINUED(status)){
-                printf(">>> [%d] %s Continued %d\n", pid, c->cmd, status);
-            }
-        } else {  // Parent process: background execution
-            // Add the background job to the job list
-            struct job j = {.pid = pid, .name = c->cmd};
-            add_job(&j);
-        }
-
-        // Label to free the command structure
-FreeCommand:
-        free_command(c);
+        // Free the pipelines, their memory is reused by the next line
+        reset_command_arena();
         c = NULL;
 
-        // Label to free the input line
+        // Label to release the input line, the buffer is reused by the next getline()
 FreeLine:
-        free(line);
-        line = NULL;
+        if (thats_cap > LINE_KEEP_MAX) {
+            free(line);  // Don't keep an outlier line's buffer for the whole session
+            line = NULL;
+            thats_cap = 0;
+        }
 
         // Check for completed background processes and remove them from the job list
-        while((child = waitpid(-1, &status, WNOHANG)) > 0) {
-            struct job *j = find_job_by_pid(child);
-            if (j != NULL) {
-                // Report the status of background jobs
-                if(WIFEXITED(status)){
-                    printf(">>> [%d] %s Exited %d\n", child, j->name, WEXITSTATUS(status));
-                } else if (WIFSIGNALED(status)){
-                    printf(">>> [%d] %s Killed %d\n", child, j->name, WTERMSIG(status));
-                } else if (WIFSTOPPED(status)){
-                    printf(">>> [%d] %s Stopped %d\n", child, j->name, WSTOPSIG(status));
-                } else if (WIFCONTINUED(status)){
-                    printf(">>> [%d] %s Continued %d\n", child, j->name, status);
-                }
-                free_job_by_pid(child);
-            }
-        }
+        reap_background_jobs();
 
     }  // End of main loop
 
@@ -356,13 +5014,29 @@ FreeLine:
 
 // Multiple ways to exit depending on what needs to be deallocated
 ExitCommand:
-    free_command(c);
+    reset_command_arena();
 
 ExitLine:    
     free(line);
 
 Exit:
+    // Give background jobs their chance to finish before the shell goes away
+    shutdown_jobs(shutdown_timeout);
+    remove_job_cgroups();
+    finish_events();
+    if (options[OPT_STATS].value) {
+        print_stats(stderr); // Kept off stdout, which may be a pipe into something else
+    }
+    if (in != NULL && in != stdin) {
+        fclose(in);
+    }
     // Helps to free global jobs list
     free_jobs();
+    arena_free(&command_arena);
+    free_path_cache();
+    free_dir_cache();
+    free_variables();
+    free_numa_topology();
+    free_history();
     return error;
 }
@@ -0,0 +1,181 @@
+#!/bin/sh
+# Regression tests for the shell: each case feeds command lines to the shell on stdin
+# and compares what it printed, prompts and job reports left out, with the expected output
+# Usage: tests/run.sh [./shell]
+
+SHELL_BIN=$(realpath "${1:-./shell}")
+WORK=$(mktemp -d)
+FAILED=0
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+# Function to compare what a case printed with what it should have: compare NAME EXPECTED ACTUAL
+compare() {
+    if [ "$3" = "$2" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        printf 'expected:\n%s\nactual:\n%s\n' "$2" "$3"
+        FAILED=1
+    fi
+}
+
+# Function to run one case: check NAME EXPECTED LINE...
+# SHELL_ARGS holds options for the shell, descriptor 3 is open on /dev/null for -e 3
+check() {
+    name=$1
+    expected=$2
+    shift 2
+    compare "$name" "$expected" \
+        "$( (printf '%s\n' "$@"; echo exit) | HISTFILE=/dev/null timeout 10 "$SHELL_BIN" $SHELL_ARGS 2>&1 3>/dev/null |
+            sed 's/^\(308sh> \)*//' | grep -v '^>>> ' | grep -v '^$')"
+}
+
+check "external command" "hello" 'echo hello'
+
+check "output redirection" "one" 'echo one >f' 'cat f'
+check "append redirection" "one
+two" 'echo one >f' 'echo two >>f' 'cat f'
+check "input redirection" "ABC" 'echo abc >f' 'tr a-z A-Z <f'
+check "descriptor redirection" "1" 'ls /nonexistent 2>e' 'wc -l <e'
+# Both stages append at once, O_APPEND keeps them from writing over each other
+check "concurrent appends" "2000" 'seq 1 1000 >>g | seq 1 1000 >>g' 'wc -l <g'
+
+check "duplicated descriptor" "1" 'ls /nonexistent 2>&1 | wc -l'
+
+
+# Function to run a command file in batch mode: batch NAME EXPECTED JOBS LINE...
+# Prints "name done" as each job is reported finished, the shell's own reports keep their order
+batch() {
+    name=$1
+    expected=$2
+    jobs=$3
+    shift 3
+    printf '%s\n' "$@" > batch
+    compare "$name" "$expected" \
+        "$(HISTFILE=/dev/null timeout 10 "$SHELL_BIN" -j "$jobs" -f batch 2>&1 |
+            sed -n 's/^>>> \[[0-9]*\] \([a-z]*\) Exited.*/\1 done/p')"
+}
+
+# A free slot is refilled right away instead of after the rest of the jobs finish
+batch "batch refills free slots" "true done
+false done
+sleep done" 2 'sleep 1' 'true' 'false'
+batch "batch keeps to its job limit" "sleep done
+true done" 1 'sleep 0.3' 'true'
+
+check "and list" "a" 'true && echo a' 'false && echo b'
+check "or list" "c" 'false || echo c' 'true || echo d'
+check "sequential list" "e
+f" 'echo e; echo f;'
+check "status of the last pipeline that ran" "h" 'false && echo g || echo h'
+check "failing builtin short-circuits" "cd: No such file or directory
+cd: No such file or directory
+i" 'cd /nonexistent && echo no' 'cd /nonexistent || echo i'
+check "background list" "a
+b
+c" 'echo a && echo b &' 'sleep 0.3' 'echo c'
+check "missing command in a list" "Could not parse command from line
+Could not parse command from line" 'echo a &&' '; echo b'
+
+
+# Function to type lines at the shell on a terminal, the only time it keeps a history: typed LINE...
+# Prints the history entries the shell listed
+typed() {
+    printf '%s\n' "$@" | HISTFILE="$WORK/history" timeout 10 script -qec "$SHELL_BIN" /dev/null 2>&1 |
+        tr -d '\r' | sed 's/^\(308sh> \)*//' | grep '^ *[0-9][0-9]*  '
+}
+
+if command -v script > /dev/null; then
+    typed 'echo one' '  ' 'echo two' > /dev/null
+    compare "history file" "echo one
+echo two" "$(cat history)"
+    # A later shell sees what the earlier one added, and its own lines after them
+    compare "history across shells" "    2  echo two
+    3  history 2
+    4  history -s one
+    1  echo one" "$(typed 'history 2' 'history -s one')"
+    # A history file that can't be written to is reported once, not after every line
+    compare "failed history append" "1" \
+        "$(printf 'true\ntrue\n' | HISTFILE=/dev/full timeout 10 script -qec "$SHELL_BIN" /dev/null 2>&1 |
+            grep -c "can't append")"
+    # Ctrl-Z stops a job ending in tee and the prompt comes back, the shell isn't a stage to block on
+    compare "stopped job ending in tee" "[1] sleep | tee (stopped)" \
+        "$({ echo 'sleep 5 | tee stopped'; sleep 1; printf '\032'; sleep 1; printf 'jobs\nkill %%1\nexit\n'; } |
+            HISTFILE=/dev/null timeout 10 script -qec "$SHELL_BIN" /dev/null 2>&1 | tr -d '\r' |
+            sed 's/^\(308sh> \)*//' | grep '(stopped)$' | sed 's/ [0-9]* / /')"
+fi
+
+mkdir globs && touch globs/b.c globs/a.c globs/c.h globs/.h.c
+check "star matches sorted" "globs/a.c globs/b.c" 'echo globs/*.c'
+check "question mark and brackets" "globs/c.h globs/a.c globs/b.c" 'echo globs/?.h globs/[ab].c'
+check "no match keeps the pattern" "globs/*.x" 'echo globs/*.x'
+check "leading dot needs a dot" "globs/.h.c" 'echo globs/.*.c'
+check "wildcard in a directory component" "globs/a.c" 'echo */a.c'
+check "noglob" "globs/*.c" 'set -o noglob' 'echo globs/*.c'
+# The listing is cached, a file made by the command before must still show up
+check "glob sees earlier commands" "globs/0.c globs/a.c globs/b.c" 'touch globs/0.c; echo globs/*.c'
+check "redirection target is not expanded" "globs/*.out" 'echo x >globs/*.out' 'ls globs/*.out'
+
+check "variable references" "x xy ax" 'V=x' 'echo $V ${V}y a$V'
+check "unset variable expands to nothing" "[]
+done" 'echo [$TEST_UNSET_VAR]' 'echo $TEST_UNSET_VAR done'
+echo 'echo $PPID' > ppid
+check "status and shell pid" "1
+yes" 'false; echo $?' 'echo $$ >pid' 'sh ppid >ppid.txt' 'cmp -s pid ppid.txt && echo yes'
+check "lone dollar is kept" "$ a$" 'echo $ a$'
+check "prefix assignment goes to the command only" "TEST_W=2
+[]" 'TEST_W=2 env | grep ^TEST_W=' 'echo [$TEST_W]'
+check "shell variable is not exported" "" 'TEST_V=1' 'env | grep ^TEST_V='
+check "export and unset" "TEST_E=3
+[]" 'export TEST_E=3' 'env | grep ^TEST_E=' 'unset TEST_E' 'env | grep ^TEST_E=' 'echo [$TEST_E]'
+check "reference in a redirection target" "x.out" 'V=x' 'echo x >$V.out' 'ls *.out'
+
+echo two > 2
+check "digit file after <" "two" 'cat <2>x' 'cat x'
+check "argument before <digit" "hello" 'echo hello <2>out' 'cat out'
+
+check "tee -a into a file" "100000
+100000" 'seq 1 100000 | tee -a teed | wc -l' 'wc -l <teed'
+check "tee reports a file it can't open" "tee: /nonexistent/x: No such file or directory
+1
+2
+1" 'seq 2 | tee /nonexistent/x' 'echo $?'
+check "tee options are not file names" "1
+2
+0" 'seq 2 | tee -i tee-i >/dev/null' 'cat tee-i' 'seq 2 | tee --version >/dev/null' 'ls | grep -c -e ^- '
+
+SHELL_ARGS="-e 3"
+check "commands keep SIGPIPE with events on" "y" 'yes | head -1'
+SHELL_ARGS=
+
+# The stream shares stderr with seq here, a slow reader must not make seq's writes fail
+compare "events on a shared descriptor" "seq Exited 0" \
+    "$(HISTFILE=/dev/null timeout 10 "$SHELL_BIN" -e 2 -c 'seq 1 300000 >&2' 2>&1 | (sleep 1; grep -o 'seq Exited [0-9]*'))"
+
+# Copies of the shell running background lists write to the same pipe as the shell
+compare "whole event records from copies of the shell" "0" \
+    "$( (for i in $(seq 200); do echo 'true && true | cat &'; done; echo 'sleep 1') |
+        HISTFILE=/dev/null timeout 20 "$SHELL_BIN" -e 3 3>&1 >/dev/null 2>&1 | grep -vc '^{"event":"[a-z]*".*}$')"
+
+# A builtin's output must not wait on a later builtin that never reads it
+compare "builtin into builtin" "$PWD" \
+    "$(BIG=$(head -c 70000 /dev/zero | tr '\0' x) HISTFILE=/dev/null timeout 10 "$SHELL_BIN" -c 'export | pwd')"
+
+printf 'echo script "$@"\n' > script && chmod +x script
+check "script without #!" "script a b
+script c" './script a b' 'set -o forkexec' './script c'
+
+check "unterminated \${" '${V ${V-} x' 'V=x' 'echo ${V ${V-} ${V}'
+
+check "fg and bg without a job" "fg: current: no such job
+bg: current: no such job" 'fg' 'bg'
+
+# cpus and node are also the names of commands, they only place a job when a list or number follows
+mkdir bin && printf '#!/bin/sh\necho node "$@"\n' > bin/node && chmod +x bin/node
+check "node is still a command" "node app.js x
+node app.js
+node app.js
+ok" 'export PATH=$PWD/bin:$PATH' 'node app.js x' 'node app.js' 'cpus 0 node app.js' 'node 0 echo ok'
+
+exit $FAILED